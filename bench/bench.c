@@ -0,0 +1,491 @@
+/* Measure how fast libtmt consumes typical terminal output.
+ *
+ *     ./bench [-q] [-s megabytes] [-c baseline [-t percent]] [file...]
+ *
+ * Synthetic corpora are generated for a plain log, colorized ls and
+ * compiler output, a vim editing session, an htop-style redraw loop, and
+ * CJK text; any files named are used as recorded corpora too.  Each is
+ * written at several chunk sizes to terminals of several sizes, and the
+ * callback overhead and the cost of resizing are measured.  The results
+ * are printed one per line, tab-separated:
+ *
+ *     name   ns   MB/s   allocs
+ *
+ * where ns is per byte for writes and per call for resizes, and allocs
+ * counts allocations made through the terminal's allocator.  With -c, the
+ * results are compared with those saved in the baseline file, and the
+ * exit status is 1 if any got slower by more than -t percent (default 10).
+ * -q uses small corpora, for a quick check that everything still runs.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <locale.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "tmt.h"
+
+#define REPEAT 3
+#define RESIZES 2000
+#define CORPUS_MAX 16
+
+typedef struct CORPUS CORPUS;
+struct CORPUS{
+    char name[64];
+    char *b;
+    size_t n;
+};
+
+typedef struct RESULT RESULT;
+struct RESULT{
+    char name[128];
+    double ns, mbps;
+    size_t allocs;
+};
+
+static CORPUS corpora[CORPUS_MAX];
+static size_t ncorpus, size = 4 << 20;
+static RESULT *results;
+static size_t nresult;
+static size_t allocs;
+static uint32_t seed;
+
+static const size_t chunks[] = {16, 512, 4096, 65536};
+static const size_t screens[][2] = {{24, 80}, {60, 200}};
+
+/**** ALLOCATION COUNTING */
+static void *
+countalloc(void *p, size_t n)
+{
+    (void)p;
+    allocs++;
+    return malloc(n);
+}
+
+static void *
+countresize(void *p, void *o, size_t n)
+{
+    (void)p;
+    allocs++;
+    return realloc(o, n);
+}
+
+static void
+countrelease(void *p, void *o)
+{
+    (void)p;
+    free(o);
+}
+
+static const TMTALLOC counting = {countalloc, countresize, countrelease, NULL};
+
+/**** CORPUS GENERATION */
+static uint32_t
+rnd(uint32_t n)
+{
+    seed = seed * 1103515245u + 12345u;
+    return (seed >> 8) % n;
+}
+
+static const char *
+pick(const char **l, size_t n)
+{
+    return l[rnd((uint32_t)n)];
+}
+#define PICK(l) pick(l, sizeof(l) / sizeof(l[0]))
+
+static const char *words[] = {
+    "request", "completed", "worker", "connection", "timeout", "session",
+    "cache", "miss", "hit", "queue", "flush", "user", "GET", "POST", "/api/v1",
+    "index.html", "retry", "backend", "upstream", "latency", "ok", "error"
+};
+
+static const char *files[] = {
+    "main.c", "parser.c", "tmt.c", "Makefile", "README.rst", "build",
+    "include", "src", "lib", "test", "docs", "a.out", "run.sh", "data.tar.gz"
+};
+
+static const char *colors[] = {
+    "01;34", "01;32", "01;36", "00", "01;31", "40;33;01", "01;35"
+};
+
+static size_t
+genlog(char *b, size_t n)
+{
+    size_t m = 0;
+    for (uint32_t i = 0; m < n - 256; i++){
+        m += (size_t)sprintf(b + m, "2017-03-%02u %02u:%02u:%02u.%03u %-5s [worker-%u]",
+                             1 + rnd(28), rnd(24), rnd(60), rnd(60), rnd(1000),
+                             rnd(10)? "INFO" : "WARN", rnd(16));
+        for (uint32_t j = 3 + rnd(10); j; j--)
+            m += (size_t)sprintf(b + m, " %s", PICK(words));
+        m += (size_t)sprintf(b + m, " in %ums\r\n", rnd(2000));
+    }
+    return m;
+}
+
+static size_t
+genls(char *b, size_t n)
+{
+    size_t m = 0;
+    while (m < n - 512){
+        if (rnd(3))
+            m += (size_t)sprintf(b + m,
+                                 "%crwxr-xr-x %2u user group %8u Mar %2u %02u:%02u "
+                                 "\033[%sm%s\033[0m\r\n",
+                                 rnd(4)? '-' : 'd', 1 + rnd(9), rnd(1u << 20),
+                                 1 + rnd(28), rnd(24), rnd(60), PICK(colors),
+                                 PICK(files));
+        else
+            m += (size_t)sprintf(b + m,
+                                 "\033[01m\033[K%s:%u:%u:\033[m\033[K "
+                                 "\033[01;35m\033[Kwarning: \033[m\033[K"
+                                 "unused variable '\033[01m\033[K%s\033[m\033[K' "
+                                 "[\033[01;35m\033[K-Wunused-variable\033[m\033[K]\r\n"
+                                 "  %4u |     \033[01;35m\033[K%s\033[m\033[K = 0;\r\n",
+                                 PICK(files), 1 + rnd(900), 1 + rnd(60),
+                                 PICK(words), 1 + rnd(900), PICK(words));
+    }
+    return m;
+}
+
+static size_t
+genvim(char *b, size_t n)
+{
+    /* A redraw, then typing, moving around, and changing lines. */
+    size_t m = (size_t)sprintf(b, "\033[?25l\033[H\033[2J");
+    for (uint32_t i = 1; i < 24; i++)
+        m += (size_t)sprintf(b + m, "\033[%u;1H\033[34m~\033[0m", i);
+    while (m < n - 512){
+        uint32_t r = rnd(100), row = 1 + rnd(23), col = 1 + rnd(70);
+        if (r < 60){
+            m += (size_t)sprintf(b + m, "\033[%u;%uH", row, col);
+            for (uint32_t j = 1 + rnd(12); j; j--)
+                b[m++] = (char)('a' + rnd(26));
+        } else if (r < 70)
+            m += (size_t)sprintf(b + m, "\033[%u;1H\033[K\033[33m%4u \033[0m%s(%s);",
+                                 row, rnd(9999), PICK(words), PICK(words));
+        else if (r < 78)
+            m += (size_t)sprintf(b + m, "\033[%u;1H\033[%uL", row, 1 + rnd(3));
+        else if (r < 86)
+            m += (size_t)sprintf(b + m, "\033[%u;1H\033[%uM", row, 1 + rnd(3));
+        else if (r < 93)
+            m += (size_t)sprintf(b + m, "\033[%u;%uH\033[%u@x\033[%uP",
+                                 row, col, 1 + rnd(4), 1 + rnd(4));
+        else
+            m += (size_t)sprintf(b + m, "\033[24;1H\033[7m%s\033[0m\033[K"
+                                 "\033[24;60H%u,%u\033[%u;%uH\033[?25h",
+                                 rnd(2)? "-- INSERT --" : "\"tmt.c\" 1306L",
+                                 row, col, row, col);
+    }
+    return m;
+}
+
+static size_t
+genless(char *b, size_t n)
+{
+    /* A pager scrolling the lines above its status line one at a time. */
+    size_t m = (size_t)sprintf(b, "\033[H\033[2J\033[1;23r");
+    while (m < n - 512){
+        m += (size_t)sprintf(b + m, "\033[23;1H\n%5u ", rnd(99999));
+        for (uint32_t j = 3 + rnd(10); j; j--)
+            m += (size_t)sprintf(b + m, " %s", PICK(words));
+        m += (size_t)sprintf(b + m, "\033[24;1H\033[7m:%u\033[0m\033[K", rnd(999));
+    }
+    return m;
+}
+
+static size_t
+genhtop(char *b, size_t n)
+{
+    /* Full redraws of meters and a process table. */
+    size_t m = 0;
+    while (m < n - 8192){
+        m += (size_t)sprintf(b + m, "\033[H");
+        for (uint32_t c = 0; c < 4; c++){
+            uint32_t u = rnd(40), s = rnd(10);
+            m += (size_t)sprintf(b + m, "  \033[36m%u\033[0m  \033[1m[\033[0;32m", c + 1);
+            for (uint32_t j = 0; j < 40; j++)
+                m += (size_t)sprintf(b + m, "%s%c", j == u? "\033[31m" : "",
+                                     j < u + s? '|' : ' ');
+            m += (size_t)sprintf(b + m, "\033[0m%5.1f%%\033[1m]\033[0m\033[K\r\n",
+                                 (u + s) * 2.5);
+        }
+        m += (size_t)sprintf(b + m, "\r\n\033[30;42m  PID USER      PRI  NI  VIRT   "
+                             "RES   SHR S CPU%% MEM%%   TIME+  Command\033[K\033[0m\r\n");
+        for (uint32_t r = 0; r < 17; r++)
+            m += (size_t)sprintf(b + m, "%s%5u %-9s  20   0 \033[1m%5uM\033[0m %5u "
+                                 "%5u S %4.1f %4.1f %2u:%02u.%02u %s\033[0m\033[K\r\n",
+                                 r? "" : "\033[30;46m", 1 + rnd(32767), "user",
+                                 rnd(4096), rnd(65536), rnd(65536), rnd(1000) / 10.0,
+                                 rnd(1000) / 10.0, rnd(60), rnd(60), rnd(100),
+                                 PICK(files));
+        m += (size_t)sprintf(b + m, "\033[30;46mF1\033[0mHelp  \033[30;46mF2\033[0mSetup"
+                             "  \033[30;46mF10\033[0mQuit\033[K");
+    }
+    return m;
+}
+
+static size_t
+putu8(char *b, unsigned long c)
+{
+    return b[0] = (char)(0xe0 | c >> 12), b[1] = (char)(0x80 | (c >> 6 & 0x3f)),
+           b[2] = (char)(0x80 | (c & 0x3f)), 3;
+}
+
+static size_t
+gencjk(char *b, size_t n)
+{
+    size_t m = 0;
+    while (m < n - 16){
+        uint32_t r = rnd(100);
+        if (r < 80)
+            m += putu8(b + m, 0x4e00 + rnd(0x9fff - 0x4e00));
+        else if (r < 90)
+            m += putu8(b + m, 0x3040 + rnd(0x60));
+        else if (r < 98)
+            b[m++] = (char)('a' + rnd(26));
+        else
+            b[m++] = '\r', b[m++] = '\n';
+    }
+    return m;
+}
+
+static void
+addcorpus(const char *name, size_t (*gen)(char *, size_t))
+{
+    CORPUS *c = corpora + ncorpus++;
+    snprintf(c->name, sizeof(c->name), "%s", name);
+    c->b = malloc(size);
+    if (!c->b)
+        perror("malloc"), exit(EXIT_FAILURE);
+    seed = 1;
+    c->n = gen(c->b, size);
+}
+
+static void
+loadcorpus(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    CORPUS *c = corpora + ncorpus;
+    if (ncorpus == CORPUS_MAX || !f)
+        perror(path), exit(EXIT_FAILURE);
+
+    const char *s = strrchr(path, '/');
+    snprintf(c->name, sizeof(c->name), "%s", s? s + 1 : path);
+    c->b = malloc(size);
+    if (!c->b)
+        perror("malloc"), exit(EXIT_FAILURE);
+    c->n = fread(c->b, 1, size, f);
+    fclose(f);
+    ncorpus++;
+}
+
+/**** MEASUREMENT */
+static double
+now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec * 1e9 + (double)t.tv_nsec;
+}
+
+static void
+report(const char *name, double ns, double mbps, size_t a)
+{
+    RESULT *r;
+    if (!(nresult & (nresult + 1))){
+        RESULT *l = realloc(results, (nresult * 2 + 1) * sizeof(RESULT));
+        if (!l)
+            perror("realloc"), exit(EXIT_FAILURE);
+        results = l;
+    }
+    r = results + nresult++;
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->ns = ns;
+    r->mbps = mbps;
+    r->allocs = a;
+}
+
+static void
+cbnone(tmt_msg_t m, TMT *vt, const void *a, void *p)
+{
+    (void)m, (void)vt, (void)a, (void)p;
+}
+
+static void
+cbdamage(tmt_msg_t m, TMT *vt, const void *a, void *p)
+{
+    /* What a typical program does: find what changed, then clean up. */
+    (void)a;
+    if (m == TMT_MSG_UPDATE){
+        size_t *cells = p;
+        for (size_t r = 0, s, e; tmt_damage_next(vt, &r, &s, &e); r++)
+            *cells += e - s;
+        tmt_clean(vt);
+    }
+}
+
+static void
+cbtext(tmt_msg_t m, TMT *vt, const void *a, void *p)
+{
+    /* An indexer: export the text of every changed line. */
+    (void)a;
+    if (m == TMT_MSG_UPDATE){
+        size_t *bytes = p, n;
+        const TMTSCREEN *s = tmt_screen(vt);
+        for (size_t r = 0; r < s->nline; r++) if (s->lines[r]->dirty)
+            *bytes += tmt_line_text(vt, r, &n)? n : 0;
+        tmt_clean(vt);
+    }
+}
+
+static void
+writes(const char *name, const CORPUS *c, size_t nline, size_t ncol,
+       size_t chunk, TMTCALLBACK cb)
+{
+    double best = 0;
+    size_t a = 0, cells = 0;
+    for (int i = 0; i < REPEAT; i++){
+        TMT *vt = tmt_open_alloc(nline, ncol, cb, &cells, NULL, &counting);
+        if (!vt)
+            perror("tmt_open"), exit(EXIT_FAILURE);
+
+        allocs = 0;
+        double s = now();
+        for (size_t o = 0; o < c->n; o += chunk)
+            tmt_write(vt, c->b + o, c->n - o < chunk? c->n - o : chunk);
+        double t = now() - s;
+        a = allocs;
+        best = i && best < t? best : t;
+        tmt_close(vt);
+    }
+    report(name, best / c->n, c->n / best * 1e3, a);
+}
+
+static void
+resizes(const CORPUS *c, bool drag)
+{
+    /* Resizing a full screen back and forth between two sizes, or a
+     * column at a time, as when a window is dragged.
+     */
+    double best = 0;
+    size_t a = 0;
+    char name[128];
+    snprintf(name, sizeof(name), drag? "resize/%s/drag" : "resize/%s/24x80-60x200",
+             c->name);
+    for (int i = 0; i < REPEAT; i++){
+        TMT *vt = tmt_open_alloc(24, 80, NULL, NULL, NULL, &counting);
+        if (!vt)
+            perror("tmt_open"), exit(EXIT_FAILURE);
+        tmt_write(vt, c->b, c->n < 65536? c->n : 65536);
+
+        allocs = 0;
+        double s = now();
+        for (int j = 0; j < RESIZES; j++){
+            size_t d = j % 80 < 40? j % 80 : 80 - j % 80;
+            if (drag)
+                tmt_resize(vt, 24 + d / 4, 80 + d);
+            else
+                tmt_resize(vt, j & 1? 24 : 60, j & 1? 80 : 200);
+        }
+        double t = now() - s;
+        a = allocs;
+        best = i && best < t? best : t;
+        tmt_close(vt);
+    }
+    report(name, best / RESIZES, 0, a);
+}
+
+static int
+compare(const char *path, double threshold)
+{
+    FILE *f = fopen(path, "r");
+    char l[512];
+    int bad = 0;
+    if (!f)
+        return perror(path), 2;
+
+    printf("# %-38s %10s %10s %8s\n", "name", "baseline", "now", "change");
+    while (fgets(l, sizeof(l), f)){
+        char name[128];
+        double ns;
+        if (l[0] == '#' || sscanf(l, "%127s %lf", name, &ns) != 2)
+            continue;
+        for (size_t i = 0; i < nresult; i++) if (!strcmp(results[i].name, name)){
+            double d = (results[i].ns - ns) / ns * 100;
+            bool slow = d > threshold;
+            printf("%-40s %10.3f %10.3f %+7.1f%%%s\n", name, ns, results[i].ns,
+                   d, slow? " SLOWER" : "");
+            bad |= slow;
+        }
+    }
+    fclose(f);
+    return bad;
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *base = NULL;
+    double threshold = 10;
+    int o;
+
+    while ((o = getopt(argc, argv, "qs:c:t:")) != -1) switch (o){
+        case 'q': size = 256 << 10;                            break;
+        case 's': size = strtoul(optarg, NULL, 10) << 20;      break;
+        case 'c': base = optarg;                               break;
+        case 't': threshold = strtod(optarg, NULL);            break;
+        default:
+            fprintf(stderr, "usage: %s [-q] [-s megabytes] [-c baseline "
+                            "[-t percent]] [file...]\n", argv[0]);
+            return 2;
+    }
+    if (size < 65536)
+        size = 65536;
+
+    if (!setlocale(LC_ALL, "C.UTF-8") && !setlocale(LC_ALL, "en_US.UTF-8"))
+        fputs("no UTF-8 locale available; cjk will be garbled\n", stderr);
+
+    addcorpus("log", genlog);
+    addcorpus("ls", genls);
+    addcorpus("vim", genvim);
+    addcorpus("less", genless);
+    addcorpus("htop", genhtop);
+    addcorpus("cjk", gencjk);
+    for (; optind < argc; optind++)
+        loadcorpus(argv[optind]);
+
+    char name[128];
+    for (size_t i = 0; i < ncorpus; i++)
+    for (size_t j = 0; j < sizeof(screens) / sizeof(screens[0]); j++)
+    for (size_t k = 0; k < sizeof(chunks) / sizeof(chunks[0]); k++){
+        snprintf(name, sizeof(name), "write/%s/%zux%zu/%zu", corpora[i].name,
+                 screens[j][0], screens[j][1], chunks[k]);
+        writes(name, corpora + i, screens[j][0], screens[j][1], chunks[k], NULL);
+    }
+
+    for (size_t i = 0; i < ncorpus; i++){
+        snprintf(name, sizeof(name), "callback/%s/none", corpora[i].name);
+        writes(name, corpora + i, 24, 80, 4096, cbnone);
+        snprintf(name, sizeof(name), "callback/%s/damage", corpora[i].name);
+        writes(name, corpora + i, 24, 80, 4096, cbdamage);
+        snprintf(name, sizeof(name), "callback/%s/text", corpora[i].name);
+        writes(name, corpora + i, 24, 80, 4096, cbtext);
+    }
+
+    for (size_t i = 0; i < ncorpus; i++){
+        resizes(corpora + i, false);
+        resizes(corpora + i, true);
+    }
+
+    if (base)
+        return compare(base, threshold);
+    printf("# name\tns\tMB/s\tallocs\n");
+    for (size_t i = 0; i < nresult; i++)
+        printf("%s\t%.3f\t%.1f\t%zu\n", results[i].name, results[i].ns,
+               results[i].mbps, results[i].allocs);
+    return EXIT_SUCCESS;
+}
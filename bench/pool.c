@@ -0,0 +1,174 @@
+/* Drive many terminals through a pool, over pipes, and check the results.
+ *
+ *     cc -O2 -I.. -o pool pool.c ../tmtpool.c ../tmt.c -lpthread
+ *     ./pool [sessions [workers [kilobytes [hot percent]]]]
+ *
+ * Each session gets its own stream of text, colors, and cursor motion,
+ * written in blocks of random size by a few writer threads; the hot ones
+ * get ten times as much.  Afterwards, each stream is replayed into a fresh
+ * terminal, whose screen must match the pooled one.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "tmtpool.h"
+
+#define WRITERS 4
+#define BLOCK 8192
+
+static size_t nsession = 1000, nworker, kbytes = 256, hot = 5;
+static int (*fds)[2];
+static size_t *sent;
+
+static uint32_t
+next(uint32_t *s)
+{
+    *s = *s * 1103515245u + 12345u;
+    return *s >> 8;
+}
+
+static size_t
+block(size_t i, size_t k, char *b)
+{
+    /* The kth block of session i's stream. */
+    uint32_t s = (uint32_t)(i * 7919 + k * 104729 + 1);
+    size_t n = 64 + next(&s) % (BLOCK - 64), m = 0;
+    while (m < n - 32){
+        uint32_t r = next(&s) % 100;
+        if (r < 70)
+            b[m++] = (char)('a' + r % 26);
+        else if (r < 80)
+            b[m++] = ' ';
+        else if (r < 87)
+            b[m++] = '\r', b[m++] = '\n';
+        else if (r < 94)
+            m += (size_t)sprintf(b + m, "\033[%um", 30 + next(&s) % 8);
+        else if (r < 97)
+            m += (size_t)sprintf(b + m, "\033[%u;%uH", next(&s) % 30, next(&s) % 90);
+        else
+            m += (size_t)sprintf(b + m, "\033[K");
+    }
+    return m;
+}
+
+static size_t
+total(size_t i)
+{
+    return kbytes * 1024 * (i % 100 < hot? 10 : 1);
+}
+
+static void *
+writer(void *a)
+{
+    size_t w = (size_t)(uintptr_t)a, k = 0;
+    static char b[WRITERS][BLOCK];
+    for (bool more = true; more; k++){
+        more = false;
+        for (size_t i = w; i < nsession; i += WRITERS){
+            if (sent[i] >= total(i)) continue;
+            size_t n = block(i, k, b[w]);
+            for (size_t o = 0; o < n; ){
+                ssize_t r = write(fds[i][1], b[w] + o, n - o);
+                if (r < 0 && errno != EINTR)
+                    perror("write"), exit(EXIT_FAILURE);
+                o += r > 0? (size_t)r : 0;
+            }
+            sent[i] += n;
+            if (sent[i] >= total(i))
+                close(fds[i][1]);
+            else
+                more = true;
+        }
+    }
+    return NULL;
+}
+
+static bool
+check(size_t i, TMT *vt)
+{
+    static char b[BLOCK];
+    TMT *ref = tmt_open(30, 90, NULL, NULL, NULL);
+    for (size_t k = 0, n = 0; n < total(i); k++){
+        size_t m = block(i, k, b);
+        tmt_write(ref, b, m);
+        n += m;
+    }
+
+    const TMTSCREEN *s = tmt_screen(vt), *r = tmt_screen(ref);
+    bool ok = memcmp(tmt_cursor(vt), tmt_cursor(ref), sizeof(TMTPOINT)) == 0;
+    for (size_t j = 0; ok && j < s->nline; j++)
+        ok = memcmp(s->lines[j]->chars, r->lines[j]->chars,
+                    s->ncol * sizeof(TMTCHAR)) == 0;
+    tmt_close(ref);
+    return ok;
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc > 1) nsession = strtoul(argv[1], NULL, 10);
+    if (argc > 2) nworker = strtoul(argv[2], NULL, 10);
+    if (argc > 3) kbytes = strtoul(argv[3], NULL, 10);
+    if (argc > 4) hot = strtoul(argv[4], NULL, 10);
+
+    TMTPOOL *p = tmt_pool_open(nworker);
+    TMTSESSION **ss = calloc(nsession, sizeof(TMTSESSION *));
+    fds = calloc(nsession, sizeof(*fds));
+    sent = calloc(nsession, sizeof(size_t));
+    if (!p || !ss || !fds || !sent)
+        return perror("tmt_pool_open"), EXIT_FAILURE;
+    for (size_t i = 0; i < nsession; i++){
+        if (pipe(fds[i]) < 0)
+            return perror("pipe"), EXIT_FAILURE;
+        ss[i] = tmt_pool_add(p, fds[i][0], 30, 90, NULL, (void *)(uintptr_t)i);
+        if (!ss[i])
+            return perror("tmt_pool_add"), EXIT_FAILURE;
+    }
+
+    struct timespec s, e;
+    pthread_t t[WRITERS];
+    clock_gettime(CLOCK_MONOTONIC, &s);
+    for (size_t i = 0; i < WRITERS; i++)
+        pthread_create(t + i, NULL, writer, (void *)(uintptr_t)i);
+
+    size_t left = nsession, nevent = 0, nwake = 0;
+    while (left){
+        TMTSESSION *x = tmt_pool_wait(p, -1);
+        TMTEVENT ev;
+        tmt_pool_lock(x);
+        while (tmt_pool_next(x, &ev))
+            nevent++;
+        if (tmt_pool_hungup(x))
+            left--;
+        tmt_pool_unlock(x);
+        nwake++;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &e);
+    for (size_t i = 0; i < WRITERS; i++)
+        pthread_join(t[i], NULL);
+
+    size_t bytes = 0, bad = 0;
+    for (size_t i = 0; i < nsession; i++){
+        bytes += sent[i];
+        bad += !check(i, tmt_pool_lock(ss[i]));
+        tmt_pool_unlock(ss[i]);
+        tmt_pool_remove(ss[i]);
+        close(fds[i][0]);
+    }
+    tmt_pool_close(p);
+    free(ss);
+    free(fds);
+    free(sent);
+
+    double d = (double)(e.tv_sec - s.tv_sec) + (e.tv_nsec - s.tv_nsec) / 1e9;
+    printf("%zu sessions, %.1f MB in %.2f s: %.1f MB/s, %zu wakeups, "
+           "%zu events, %zu mismatched\n", nsession, bytes / 1e6, d,
+           bytes / d / 1e6, nwake, nevent, bad);
+    return bad? EXIT_FAILURE : EXIT_SUCCESS;
+}
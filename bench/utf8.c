@@ -0,0 +1,108 @@
+/* Copyright (c) 2017 Rob King
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the copyright holder nor the
+ *     names of contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS,
+ * COPYRIGHT HOLDERS, OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Compare the multibyte decoders on CJK- and emoji-heavy input.
+ * Build it once against each decoder and run both:
+ *
+ *     cc -O2 -I.. -o utf8-mbrtowc utf8.c ../tmt.c
+ *     cc -O2 -I.. -DTMT_UTF8 -o utf8-dfa utf8.c ../tmt.c
+ */
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "tmt.h"
+
+#define SIZE (16 * 1024 * 1024)
+#define CHUNK 4096
+
+static size_t
+putu8(char *b, unsigned long c)
+{
+    if (c < 0x80)
+        return b[0] = (char)c, 1;
+    if (c < 0x800)
+        return b[0] = (char)(0xc0 | c >> 6), b[1] = (char)(0x80 | (c & 0x3f)), 2;
+    if (c < 0x10000)
+        return b[0] = (char)(0xe0 | c >> 12), b[1] = (char)(0x80 | (c >> 6 & 0x3f)),
+               b[2] = (char)(0x80 | (c & 0x3f)), 3;
+    return b[0] = (char)(0xf0 | c >> 18), b[1] = (char)(0x80 | (c >> 12 & 0x3f)),
+           b[2] = (char)(0x80 | (c >> 6 & 0x3f)), b[3] = (char)(0x80 | (c & 0x3f)), 4;
+}
+
+static size_t
+corpus(char *b, unsigned long lo, unsigned long hi, int ascii)
+{
+    /* Random characters from [lo, hi], with ascii percent of them
+     * replaced by plain words and a newline every so often.
+     */
+    size_t n = 0;
+    srand(1);
+    while (n < SIZE - 8){
+        if (rand() % 100 < ascii)
+            n += putu8(b + n, (unsigned long)('a' + rand() % 26));
+        else
+            n += putu8(b + n, lo + (unsigned long)rand() % (hi - lo + 1));
+        if (rand() % 60 == 0)
+            b[n++] = '\n';
+    }
+    return n;
+}
+
+static void
+run(const char *name, const char *b, size_t n)
+{
+    TMT *vt = tmt_open(60, 200, NULL, NULL, NULL);
+    struct timespec s, e;
+
+    if (!vt)
+        perror("tmt_open"), exit(EXIT_FAILURE);
+
+    clock_gettime(CLOCK_MONOTONIC, &s);
+    for (size_t p = 0; p < n; p += CHUNK)
+        tmt_write(vt, b + p, n - p < CHUNK? n - p : CHUNK);
+    clock_gettime(CLOCK_MONOTONIC, &e);
+
+    double t = (double)(e.tv_sec - s.tv_sec) + (e.tv_nsec - s.tv_nsec) / 1e9;
+    printf("%-8s %8.1f MB/s %8.2f ns/byte\n", name, n / t / 1e6, t * 1e9 / n);
+    tmt_close(vt);
+}
+
+int
+main(void)
+{
+    static char b[SIZE];
+
+    if (!setlocale(LC_ALL, "C.UTF-8") && !setlocale(LC_ALL, "en_US.UTF-8"))
+        return fputs("no UTF-8 locale available\n", stderr), EXIT_FAILURE;
+
+    run("cjk", b, corpus(b, 0x4e00, 0x9fff, 10));
+    run("emoji", b, corpus(b, 0x1f300, 0x1f64f, 30));
+    run("latin1", b, corpus(b, 0xa0, 0xff, 70));
+    return EXIT_SUCCESS;
+}
@@ -24,6 +24,9 @@
  * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
+#if defined(TMT_HAS_POLL) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
 #include <limits.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -31,18 +34,49 @@
 #include <string.h>
 #include "tmt.h"
 
+#ifdef TMT_HAS_REGEX
+#include <regex.h>
+#endif
+
+#ifdef TMT_HAS_POLL
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#if defined(TMT_UTF8) || defined(__STDC_ISO_10646__)
+#define TMT_UNICODE
+#include "tmtwidth.h"
+#endif
+
 #define BUF_MAX 100
-#define PAR_MAX 8
+#define PAR_MAX 16
+#define RGB_MAX (0x800 - TMT_COLOR_RGB)
 #define TAB 8
+#define HIST_SEG 16384
+#define INBUF 65536
+#define SNAP_MAGIC 0x53544d54 /* "TMTS" */
+#define SNAP_VERSION 2
+#define SNAP_HEAD (4 * (21 + PAR_MAX))
 #define MAX(x, y) (((size_t)(x) > (size_t)(y)) ? (size_t)(x) : (size_t)(y))
 #define MIN(x, y) (((size_t)(x) < (size_t)(y)) ? (size_t)(x) : (size_t)(y))
 #define CLINE(vt) (vt)->screen.lines[MIN((vt)->curs.r, (vt)->screen.nline - 1)]
 
 #define P0(x) (vt->pars[x])
 #define P1(x) (vt->pars[x]? vt->pars[x] : 1)
-#define CB(vt, m, a) ((vt)->cb? (vt)->cb(m, vt, a, (vt)->p) : (void)0)
+#define CB(vt, m, a) ((vt)->cb? (STAT(vt, callbacks, 1), (vt)->cb(m, vt, a, (vt)->p)) : (void)0)
+#define ALLOC(vt, n) ((vt)->mem.alloc((vt)->mem.p, n))
+#define RESIZE(vt, o, n) ((vt)->mem.resize((vt)->mem.p, o, n))
+#define RELEASE(vt, o) ((o)? (vt)->mem.release((vt)->mem.p, o) : (void)0)
 #define INESC ((vt)->state)
 
+#ifdef TMT_STATS
+#define STAT(vt, f, n) ((vt)->stats.f += (n))
+#else
+#define STAT(vt, f, n) ((void)0)
+#endif
+
 #define COMMON_VARS             \
     TMTSCREEN *s = &vt->screen; \
     TMTPOINT *c = &vt->curs;    \
@@ -51,21 +85,182 @@
 
 #define HANDLER(name) static void name (TMT *vt) { COMMON_VARS; 
 
+/* Bookkeeping that the library keeps for each line, stored just before
+ * the TMTLINE itself so that it moves along with the line.
+ */
+typedef struct LINEINFO LINEINFO;
+struct LINEINFO{
+    size_t ds, de; /* the columns [ds, de) have changed */
+    uint64_t gen;  /* bumped on every change to the line's contents */
+    size_t blank;  /* the cells from here on are blank, whatever they hold;
+                      SIZE_MAX unless the line is on the lazy list */
+    TMTATTRS a;    /* the rendition of every cell, unless mixed is set */
+    bool mixed;
+    size_t wrap;   /* if not 0, the line was wrapped after this many cells
+                      and goes on in the next */
+};
+#define INFO(l) ((LINEINFO *)(l) - 1)
+
+/* A line in a TMTSTORE, shared by all the compacted terminals that have
+ * a line just like it.  The line itself follows, so that info is its
+ * LINEINFO as usual.
+ */
+typedef struct SHARED SHARED;
+struct SHARED{
+    SHARED *next;
+    size_t refs, hash, ncol;
+    LINEINFO info;
+};
+#define SHAREDLINE(h) ((TMTLINE *)((h) + 1))
+#define LINESHARED(l) ((SHARED *)(l) - 1)
+
+struct TMTSTORE{
+    TMTALLOC mem;
+    SHARED **buckets;
+    size_t nbucket, nline;
+};
+
+/* A segment of scrollback history: encoded lines are appended at the
+ * front of data, and the offset of each is stored at the back.
+ */
+typedef struct HISTSEG HISTSEG;
+struct HISTSEG{
+    size_t first, nline, used, size;
+    unsigned char data[];
+};
+#define SLOT(g, i) (((uint32_t *)((g)->data + (g)->size))[-1 - (ptrdiff_t)(i)])
+
+/* A pattern registered with tmt_expect_add or tmt_expect_add_regex. */
+typedef struct EXPECT EXPECT;
+struct EXPECT{
+    int id;
+    char *s; /* a literal, or NULL */
+    #ifdef TMT_HAS_REGEX
+    regex_t *re;
+    #endif
+};
+
+/* The first match of a pattern on a line, as last reported. */
+typedef struct SEEN SEEN;
+struct SEEN{
+    int id;
+    size_t s, e;
+};
+
+/* The text of a line as of generation gen, and the matches last
+ * reported on the line.
+ */
+typedef struct TEXT TEXT;
+struct TEXT{
+    uint64_t gen;
+    char *s;
+    size_t len, size;
+    SEEN *seen;
+    size_t nseen, szseen;
+};
+
+/* A row of the screen as it was before a resize. */
+typedef struct ROW ROW;
+struct ROW{
+    LINEINFO info;
+    TEXT text;
+    size_t len; /* its cells without trailing blanks */
+    bool dirty;
+};
+
+/* The old screen being rewrapped by a resize: its rows and their cells,
+ * how many new rows go to the history rather than the screen (or
+ * SIZE_MAX to only count them), and where the cursor was and will be.
+ */
+typedef struct REFLOW REFLOW;
+struct REFLOW{
+    const ROW *rows;
+    const TMTCHAR *cells;
+    size_t nline, ncol, skip;
+    TMTPOINT from, to;
+};
+
+#ifdef TMT_PUBLISH
+#include <stdatomic.h>
+#define FRESH 4u
+
+/* A published frame; its cells live in the same allocation. */
+typedef struct FRAME FRAME;
+struct FRAME{
+    TMTFRAME f;
+    uint64_t *gen; /* the line generation each row was copied from */
+    size_t *since;
+};
+#endif
+
+#ifdef TMT_UTF8
+#define MBIDLE(vt) ((vt)->u8s == U8_ACCEPT)
+#else
+#define MBIDLE(vt) (!(vt)->nmb && mbsinit(&(vt)->ms))
+#endif
+
 struct TMT{
-    TMTPOINT curs, oldcurs;
+    TMTPOINT curs, oldcurs, bcurs;
     TMTATTRS attrs, oldattrs;
 
     bool dirty, acs, ignored;
     TMTSCREEN screen;
     TMTLINE *tabs;
+    TMTLINE **ring, **lazy;
+    void *slab;
+    size_t capline, capcol; /* the slab has room for this many lines and columns */
+    TMTSTORE *store;  /* the store holding the lines, if compacted */
+    uint64_t *gens;   /* and their generations */
+    size_t base, moved, movede, batch, nlazy;
+    size_t top, bot; /* the scrolling region is rows [top, bot) */
+    uint64_t gen;
 
     TMTCALLBACK cb;
     void *p;
     const wchar_t *acschars;
+    TMTALLOC mem;
+
+    uint32_t *rgb;
+    size_t nrgb, szrgb;
 
+    HISTSEG **segs;
+    size_t nseg, szsegs;
+    size_t hmax, hbytes, hfirst, hline;
+    unsigned char *hbuf;
+    size_t szhbuf;
+
+    char *inbuf;
+
+    EXPECT *pats;
+    size_t npat, szpat;
+    TEXT *texts;   /* by place in the slab, or by row if compacted */
+    char *text;    /* where the text of a line is put together */
+    size_t sztext;
+    uint64_t sgen; /* lines of a later generation haven't been searched */
+    TMTMATCH *want;
+
+    ROW *rows;     /* the screen as it was before the last resize */
+    size_t szrows;
+
+    #ifdef TMT_STATS
+    TMTSTATS stats;
+    #endif
+
+    #ifdef TMT_PUBLISH
+    FRAME *frames[3];
+    unsigned back, last, front;
+    atomic_uint mid;
+    size_t seq;
+    #endif
+
+    #ifdef TMT_UTF8
+    unsigned char u8s;
+    wchar_t u8c;
+    #else
     mbstate_t ms;
     size_t nmb;
     char mb[BUF_MAX + 1];
+    #endif
 
     size_t pars[PAR_MAX];   
     size_t npar;
@@ -74,7 +269,12 @@ struct TMT{
 };
 
 static TMTATTRS defattrs = {.fg = TMT_COLOR_DEFAULT, .bg = TMT_COLOR_DEFAULT};
+static TMTCHAR blankchar = {L' ', {.fg = TMT_COLOR_DEFAULT, .bg = TMT_COLOR_DEFAULT}};
 static void writecharatcurs(TMT *vt, wchar_t w);
+static void unexpect(TMT *vt, EXPECT *x);
+static TEXT *linetext(TMT *vt, size_t r);
+static void forget(TMT *vt, const TMTLINE *l);
+static uint32_t packattrs(TMTATTRS a);
 
 static wchar_t
 tacs(const TMT *vt, unsigned char c)
@@ -91,22 +291,115 @@ tacs(const TMT *vt, unsigned char c)
     return (wchar_t)c;
 }
 
+static void
+damage(TMT *vt, TMTLINE *l, size_t s, size_t e)
+{
+    LINEINFO *i = INFO(l);
+
+    vt->dirty = l->dirty = true;
+    i->gen = ++vt->gen;
+    if (s >= e)
+        return;
+    else if (i->ds >= i->de){
+        i->ds = s;
+        i->de = e;
+    } else{
+        i->ds = MIN(i->ds, s);
+        i->de = MAX(i->de, e);
+    }
+}
+
 static void
 dirtylines(TMT *vt, size_t s, size_t e)
 {
     vt->dirty = true;
     for (size_t i = s; i < e; i++)
-        vt->screen.lines[i]->dirty = true;
+        damage(vt, vt->screen.lines[i], 0, vt->screen.ncol);
+}
+
+static bool
+sameattrs(TMTATTRS a, TMTATTRS b)
+{
+    return packattrs(a) == packattrs(b);
+}
+
+static void
+styled(TMTLINE *l, TMTATTRS a, bool all)
+{
+    /* Note that some cells of l now have rendition a, or all of them. */
+    LINEINFO *i = INFO(l);
+    if (all){
+        i->a = a;
+        i->mixed = false;
+    } else
+        i->mixed |= !sameattrs(i->a, a);
+}
+
+static void
+solid(TMTLINE *l, size_t s, size_t e)
+{
+    /* Fill in the blanks before s, and note that [s, e) is about to
+     * be written.
+     */
+    LINEINFO *i = INFO(l);
+    size_t j = i->blank;
+    for (; j < s; j++)
+        l->chars[j] = blankchar;
+    i->blank = MAX(j, e);
+}
+
+static void
+splitwide(TMT *vt, TMTLINE *l, size_t s, size_t e)
+{
+    /* [s, e) is about to be overwritten; blank the other halves of any
+     * double-width characters that it cuts in two.
+     */
+    LINEINFO *i = INFO(l);
+    if (s && s < i->blank && !l->chars[s].c){
+        l->chars[s - 1] = blankchar;
+        styled(l, defattrs, false);
+        damage(vt, l, s - 1, s);
+    }
+    if (e < vt->screen.ncol && e < i->blank && !l->chars[e].c){
+        l->chars[e] = blankchar;
+        styled(l, defattrs, false);
+        damage(vt, l, e, e + 1);
+    }
 }
 
 static void
 clearline(TMT *vt, TMTLINE *l, size_t s, size_t e)
 {
-    vt->dirty = l->dirty = true;
-    for (size_t i = s; i < e && i < vt->screen.ncol; i++){
-        l->chars[i].a = defattrs;
-        l->chars[i].c = L' ';
+    /* Clearing to the end of a line only marks it as blank from s on;
+     * the cells are filled in when written, or before the program
+     * next gets to look at them.
+     */
+    LINEINFO *i = INFO(l);
+    e = MIN(e, vt->screen.ncol);
+    if (s < e)
+        splitwide(vt, l, s, e);
+    damage(vt, l, s, e);
+    styled(l, defattrs, s == 0 && e == vt->screen.ncol);
+    STAT(vt, cleared, e > s? e - s : 0);
+    if (e == vt->screen.ncol && l != vt->tabs){
+        i->wrap = 0;
+        if (!s)
+            forget(vt, l);
+        if (i->blank == SIZE_MAX)
+            vt->lazy[vt->nlazy++] = l;
+        i->blank = MIN(i->blank, s);
+    } else for (size_t j = s; j < e && j < i->blank; j++)
+        l->chars[j] = blankchar;
+}
+
+static void
+fillblanks(TMT *vt)
+{
+    for (size_t i = 0; i < vt->nlazy; i++){
+        solid(vt->lazy[i], vt->screen.ncol, vt->screen.ncol);
+        INFO(vt->lazy[i])->blank = SIZE_MAX;
     }
+    vt->nlazy = 0;
 }
 
 static void
@@ -116,44 +409,258 @@ clearlines(TMT *vt, size_t r, size_t n)
         clearline(vt, vt->screen.lines[i], 0, vt->screen.ncol);
 }
 
-static void
-scrup(TMT *vt, size_t r, size_t n)
+static uint32_t
+packattrs(TMTATTRS a)
+{
+    return (uint32_t)a.bold | (uint32_t)a.dim << 1 | (uint32_t)a.underline << 2
+         | (uint32_t)a.blink << 3 | (uint32_t)a.reverse << 4
+         | (uint32_t)a.invisible << 5 | ((uint32_t)a.fg & 0xfff) << 6
+         | ((uint32_t)a.bg & 0xfff) << 18;
+}
+
+static TMTATTRS
+unpackattrs(uint32_t p)
+{
+    /* Cells are compared bytewise, so the padding bits must be zero. */
+    int fg = p >> 6 & 0xfff, bg = p >> 18 & 0xfff;
+    TMTATTRS a;
+    memset(&a, 0, sizeof(a));
+    a.bold = p & 1;
+    a.dim = p >> 1 & 1;
+    a.underline = p >> 2 & 1;
+    a.blink = p >> 3 & 1;
+    a.reverse = p >> 4 & 1;
+    a.invisible = p >> 5 & 1;
+    a.fg = fg & 0x800? fg - 0x1000 : fg;
+    a.bg = bg & 0x800? bg - 0x1000 : bg;
+    return a;
+}
+
+static bool
+samecells(const TMTCHAR *a, const TMTCHAR *b, size_t n)
+{
+    /* Cells are compared by what they hold, whatever their padding. */
+    for (size_t i = 0; i < n; i++)
+        if (a[i].c != b[i].c || packattrs(a[i].a) != packattrs(b[i].a))
+            return false;
+    return true;
+}
+
+static unsigned char *
+putnum(unsigned char *b, uint32_t n)
+{
+    for (; n >= 0x80; n >>= 7)
+        *b++ = (unsigned char)(n | 0x80);
+    *b++ = (unsigned char)n;
+    return b;
+}
+
+static const unsigned char *
+getnum(const unsigned char *b, uint32_t *n)
 {
-    n = MIN(n, vt->screen.nline - 1 - r);
+    *n = 0;
+    for (int i = 0; i < 35; i += 7, b++){
+        *n |= (uint32_t)(*b & 0x7f) << i;
+        if (!(*b & 0x80)) return b + 1;
+    }
+    return b;
+}
 
+static void
+histevict(TMT *vt)
+{
+    size_t n = 0;
+    while (n + 1 < vt->nseg && vt->hbytes > vt->hmax){
+        HISTSEG *g = vt->segs[n++];
+        vt->hbytes -= sizeof(HISTSEG) + g->size;
+        vt->hfirst += g->nline;
+        vt->hline -= g->nline;
+        RELEASE(vt, g);
+    }
     if (n){
+        vt->nseg -= n;
+        memmove(vt->segs, vt->segs + n, vt->nseg * sizeof(HISTSEG *));
+    }
+}
+
+static size_t
+histencode(TMT *vt, const TMTLINE *l)
+{
+    /* A line is its length and then runs of characters, each its length,
+     * its packed attributes, and its characters. Trailing blanks are
+     * left off entirely.
+     */
+    size_t n = MIN(vt->screen.ncol, INFO(l)->blank);
+    while (n && l->chars[n - 1].c == L' ' && sameattrs(l->chars[n - 1].a, defattrs))
+        n--;
+
+    size_t sz = 5 + n * 14;
+    if (sz > vt->szhbuf){
+        unsigned char *nb = RESIZE(vt, vt->hbuf, sz);
+        if (!nb) return 0;
+        vt->hbuf = nb;
+        vt->szhbuf = sz;
+    }
+
+    unsigned char *p = putnum(vt->hbuf, (uint32_t)n);
+    for (size_t i = 0, j; i < n; i = j){
+        TMTATTRS a = l->chars[i].a;
+        uint32_t v = packattrs(a);
+        for (j = i + 1; j < n && sameattrs(l->chars[j].a, a); j++)
+            ;
+        p = putnum(p, (uint32_t)(j - i));
+        for (int k = 0; k < 4; k++)
+            *p++ = (unsigned char)(v >> (8 * k));
+        for (size_t k = i; k < j; k++)
+            p = putnum(p, (uint32_t)l->chars[k].c);
+    }
+    return (size_t)(p - vt->hbuf);
+}
+
+static void
+histpush(TMT *vt, const TMTLINE *l)
+{
+    size_t n = histencode(vt, l);
+    HISTSEG *g = vt->nseg? vt->segs[vt->nseg - 1] : NULL;
+    if (!n) return;
+
+    if (!g || g->used + n + (g->nline + 1) * sizeof(uint32_t) > g->size){
+        size_t sz = (MIN(HIST_SEG, MAX(vt->hmax / 8, 512)) + 3) & ~(size_t)3;
+        sz = MAX(sz, (n + sizeof(uint32_t) + 3) & ~(size_t)3);
+        if (vt->nseg == vt->szsegs){
+            size_t ns = vt->szsegs? vt->szsegs * 2 : 16;
+            HISTSEG **s = RESIZE(vt, vt->segs, ns * sizeof(HISTSEG *));
+            if (!s) return;
+            vt->segs = s;
+            vt->szsegs = ns;
+        }
+        if (!(g = ALLOC(vt, sizeof(HISTSEG) + sz))) return;
+        g->first = vt->hfirst + vt->hline;
+        g->nline = g->used = 0;
+        g->size = sz;
+        vt->segs[vt->nseg++] = g;
+        vt->hbytes += sizeof(HISTSEG) + sz;
+    }
+
+    memcpy(g->data + g->used, vt->hbuf, n);
+    SLOT(g, g->nline) = (uint32_t)g->used;
+    g->used += n;
+    g->nline++;
+    vt->hline++;
+    histevict(vt);
+}
+
+static void
+rotate(TMT *vt, size_t n)
+{
+    /* Every line appears twice in the ring, nline entries apart, so
+     * scrolling the whole screen up by n is just moving the base.
+     */
+    vt->base = (vt->base + n) % vt->screen.nline;
+    vt->screen.lines = vt->ring + vt->base;
+}
+
+static void
+syncring(TMT *vt)
+{
+    size_t n = vt->screen.nline;
+    for (size_t i = vt->base; i < vt->base + n; i++)
+        vt->ring[i < n? i + n : i - n] = vt->ring[i];
+}
+
+static void
+scrolled(TMT *vt, size_t r, size_t n, bool up)
+{
+    /* Lines that only moved keep their damage; the dirty flags
+     * are set for them just once, when we next notify.
+     */
+    TMTSCROLL m = {r, vt->bot, n, up};
+    vt->dirty = true;
+    vt->moved = MIN(vt->moved, r);
+    vt->movede = MAX(vt->movede, vt->bot);
+    STAT(vt, scrolled, n);
+    CB(vt, TMT_MSG_SCROLL, &m);
+}
+
+static void
+scrup(TMT *vt, size_t r, size_t n, bool hist)
+{
+    /* Scroll rows [r, bot) up; rows outside the scrolling region
+     * don't move.  If hist is set, lines scrolled off the top of the
+     * screen go into the history; deleted lines never do.
+     */
+    size_t e = vt->bot;
+    if (r < vt->top || r >= e) return;
+    n = MIN(n, e - 1 - r);
+
+    for (size_t i = 0; vt->hmax && hist && !r && i < n; i++)
+        histpush(vt, vt->screen.lines[i]);
+
+    if (n && !r && e == vt->screen.nline)
+        rotate(vt, n);
+    else if (n){
         TMTLINE *buf[n];
 
         memcpy(buf, vt->screen.lines + r, n * sizeof(TMTLINE *));
         memmove(vt->screen.lines + r, vt->screen.lines + r + n,
-                (vt->screen.nline - n - r) * sizeof(TMTLINE *));
-        memcpy(vt->screen.lines + (vt->screen.nline - n),
-               buf, n * sizeof(TMTLINE *));
+                (e - n - r) * sizeof(TMTLINE *));
+        memcpy(vt->screen.lines + (e - n), buf, n * sizeof(TMTLINE *));
+        syncring(vt);
+    }
 
-        clearlines(vt, vt->screen.nline - n, n);
-        dirtylines(vt, r, vt->screen.nline);
+    if (n){
+        clearlines(vt, e - n, n);
+        scrolled(vt, r, n, true);
     }
 }
 
 static void
 scrdn(TMT *vt, size_t r, size_t n)
 {
-    n = MIN(n, vt->screen.nline - 1 - r);
+    size_t e = vt->bot;
+    if (r < vt->top || r >= e) return;
+    n = MIN(n, e - 1 - r);
 
-    if (n){
+    if (n && !r && e == vt->screen.nline)
+        rotate(vt, vt->screen.nline - n);
+    else if (n){
         TMTLINE *buf[n];
 
-        memcpy(buf, vt->screen.lines + (vt->screen.nline - n),
-               n * sizeof(TMTLINE *));
+        memcpy(buf, vt->screen.lines + (e - n), n * sizeof(TMTLINE *));
         memmove(vt->screen.lines + r + n, vt->screen.lines + r,
-                (vt->screen.nline - n - r) * sizeof(TMTLINE *));
+                (e - n - r) * sizeof(TMTLINE *));
         memcpy(vt->screen.lines + r, buf, n * sizeof(TMTLINE *));
-    
+        syncring(vt);
+    }
+
+    if (n){
         clearlines(vt, r, n);
-        dirtylines(vt, r, vt->screen.nline);
+        scrolled(vt, r, n, false);
     }
 }
 
+static void
+linefeed(TMT *vt)
+{
+    if (vt->curs.r == vt->bot - 1)
+        scrup(vt, vt->top, 1, true);
+    else if (vt->curs.r < vt->screen.nline - 1)
+        vt->curs.r++;
+}
+
+static void
+stbm(TMT *vt)
+{
+    TMTSCREEN *s = &vt->screen;
+    TMTPOINT *c = &vt->curs;
+    size_t top = P1(0) - 1, bot = P0(1)? P0(1) : s->nline;
+    if (top + 1 >= bot || bot > s->nline) return;
+
+    vt->top = top;
+    vt->bot = bot;
+    c->r = c->c = 0;
+}
+
 HANDLER(ed)
     size_t b = 0;
     size_t e = s->nline;
@@ -169,13 +676,14 @@ HANDLER(ed)
 }
 
 HANDLER(ich)
-    size_t n = P1(0); /* XXX use MAX */
-    if (n > s->ncol - c->c - 1) n = s->ncol - c->c - 1;
+    size_t n = MIN(P1(0), s->ncol - c->c);
 
+    splitwide(vt, l, s->ncol - n, s->ncol);
+    solid(l, s->ncol, s->ncol);
     memmove(l->chars + c->c + n, l->chars + c->c,
-            MIN(s->ncol - 1 - c->c,
-            (s->ncol - c->c - n - 1)) * sizeof(TMTCHAR));
-    clearline(vt, l, c->c, n);
+            (s->ncol - c->c - n) * sizeof(TMTCHAR));
+    damage(vt, l, c->c, s->ncol);
+    clearline(vt, l, c->c, c->c + n);
 }
 
 HANDLER(dch)
@@ -183,9 +691,13 @@ HANDLER(dch)
     if (n > s->ncol - c->c) n = s->ncol - c->c;
     else if (n == 0) return;
 
+    splitwide(vt, l, c->c, c->c + n);
+    solid(l, s->ncol, s->ncol);
     memmove(l->chars + c->c, l->chars + c->c + n,
             (s->ncol - c->c - n) * sizeof(TMTCHAR));
+    damage(vt, l, c->c, s->ncol);
 
+    l->chars[s->ncol - n] = blankchar; /* for splitwide() */
     clearline(vt, l, s->ncol - n, s->ncol);
     /* VT102 manual says the attribute for the newly empty characters
      * should be the same as the last character moved left, which isn't
@@ -201,17 +713,85 @@ HANDLER(el)
     }
 }
 
+static tmt_color_t
+palette(size_t n)
+{
+    if (n < 8)
+        return (tmt_color_t)(TMT_COLOR_BLACK + (int)n);
+    return (tmt_color_t)(TMT_COLOR_PALETTE + (int)n);
+}
+
+static size_t
+cube(size_t v)
+{
+    /* The nearest level of the 6x6x6 color cube; see tmt_color_rgb(). */
+    return v < 48? 0 : v < 115? 1 : (v - 35) / 40;
+}
+
+static tmt_color_t
+truecolor(TMT *vt, size_t r, size_t g, size_t b)
+{
+    /* Cells only have room for a small color number, so 24-bit colors
+     * are kept in a per-terminal table and cells refer to their index.
+     * Once the table is full, further colors get the nearest palette
+     * color instead.
+     */
+    r = MIN(r, 255); g = MIN(g, 255); b = MIN(b, 255);
+    uint32_t v = (uint32_t)(r << 16 | g << 8 | b);
+
+    for (size_t i = vt->nrgb; i > 0; i--) if (vt->rgb[i - 1] == v)
+        return (tmt_color_t)(TMT_COLOR_RGB + (int)(i - 1));
+
+    if (vt->nrgb == vt->szrgb && vt->szrgb < RGB_MAX){
+        size_t n = MIN(MAX(vt->szrgb * 2, 16), RGB_MAX);
+        uint32_t *t = RESIZE(vt, vt->rgb, n * sizeof(uint32_t));
+        if (t){
+            vt->rgb = t;
+            vt->szrgb = n;
+        }
+    }
+
+    if (vt->nrgb == vt->szrgb)
+        return palette(16 + 36 * cube(r) + 6 * cube(g) + cube(b));
+    vt->rgb[vt->nrgb] = v;
+    return (tmt_color_t)(TMT_COLOR_RGB + (int)vt->nrgb++);
+}
+
+static size_t
+extcolor(TMT *vt, size_t i)
+{
+    /* Handle 38;5;n and 38;2;r;g;b (or 48 for the background) starting
+     * at parameter i, returning how many more parameters were used.
+     */
+    tmt_color_t c;
+    size_t n;
+
+    if (i + 2 < vt->npar && P0(i + 1) == 5 && P0(i + 2) < 256)
+        c = palette(P0(i + 2)), n = 2;
+    else if (i + 4 < vt->npar && P0(i + 1) == 2)
+        c = truecolor(vt, P0(i + 2), P0(i + 3), P0(i + 4)), n = 4;
+    else
+        return vt->npar; /* malformed, so ignore the rest */
+
+    if (P0(i) == 38)
+        vt->attrs.fg = c;
+    else
+        vt->attrs.bg = c;
+    return n;
+}
+
 HANDLER(sgr)
-    #define FGBG(c) *(P0(i) < 40? &vt->attrs.fg : &vt->attrs.bg) = c
+    #define FGBG(c) (P0(i) < 40? (vt->attrs.fg = c) : (vt->attrs.bg = c))
     for (size_t i = 0; i < vt->npar; i++) switch (P0(i)){
         case  0: vt->attrs                    = defattrs;   break;
-        case  1: case 22: vt->attrs.bold      = P0(0) < 20; break;
-        case  2: case 23: vt->attrs.dim       = P0(0) < 20; break;
-        case  4: case 24: vt->attrs.underline = P0(0) < 20; break;
-        case  5: case 25: vt->attrs.blink     = P0(0) < 20; break;
-        case  7: case 27: vt->attrs.reverse   = P0(0) < 20; break;
-        case  8: case 28: vt->attrs.invisible = P0(0) < 20; break;
-        case 10: case 11: vt->acs             = P0(0) > 10; break;
+        case  1: case 22: vt->attrs.bold      = P0(i) < 20; break;
+        case  2: case 23: vt->attrs.dim       = P0(i) < 20; break;
+        case  4: case 24: vt->attrs.underline = P0(i) < 20; break;
+        case  5: case 25: vt->attrs.blink     = P0(i) < 20; break;
+        case  7: case 27: vt->attrs.reverse   = P0(i) < 20; break;
+        case  8: case 28: vt->attrs.invisible = P0(i) < 20; break;
+        case 10: case 11: vt->acs             = P0(i) > 10; break;
+        case 38: case 48: i += extcolor(vt, i);             break;
         case 30: case 40: FGBG(TMT_COLOR_BLACK);            break;
         case 31: case 41: FGBG(TMT_COLOR_RED);              break;
         case 32: case 42: FGBG(TMT_COLOR_GREEN);            break;
@@ -226,7 +806,10 @@ HANDLER(sgr)
 
 HANDLER(rep)
     if (!c->c) return;
+    solid(l, c->c, c->c);
     wchar_t r = l->chars[c->c - 1].c;
+    if (!r && c->c > 1)
+        r = l->chars[c->c - 2].c;
     for (size_t i = 0; i < P1(0); i++)
         writecharatcurs(vt, r);
 }
@@ -253,210 +836,1090 @@ HANDLER(fixcursor)
     c->c = MIN(c->c, s->ncol - 1);
 }
 
+/* Parser actions. Each (state, byte) pair maps to exactly one of these
+ * through the actions table below, so handlechar() does a single lookup
+ * per byte no matter what the byte is.
+ */
+enum{
+    A_NONE, A_SKIP, A_ESC, A_IGN, A_CSI, A_SEP, A_QUES, A_DIGIT,
+    A_BEL, A_BS, A_HT, A_LF, A_CR, A_HTS, A_SC, A_RC, A_RIS,
+    A_CUU, A_CUD, A_CUF, A_CUB, A_CNL, A_CPL, A_CHA, A_VPA, A_CUP,
+    A_CHT, A_ED, A_EL, A_IL, A_DL, A_DCH, A_SU, A_SD, A_ECH, A_CBT,
+    A_REP, A_DA, A_TBC, A_SGR, A_DSR, A_SM, A_MC, A_RM, A_SCP, A_RCP,
+    A_ICH, A_STBM
+};
+
+static const unsigned char actions[][UCHAR_MAX + 1] = {
+    [S_NUL] = {
+        [0x00] = A_SKIP, [0x07] = A_BEL,  [0x08] = A_BS,   [0x09] = A_HT,
+        [0x0a] = A_LF,   [0x0d] = A_CR,   [0x1b] = A_ESC
+    },
+    [S_ESC] = {
+        [0x00] = A_SKIP, [0x1b] = A_ESC,  ['H']  = A_HTS,  ['7']  = A_SC,
+        ['8']  = A_RC,   ['+']  = A_IGN,  ['*']  = A_IGN,  ['(']  = A_IGN,
+        [')']  = A_IGN,  ['c']  = A_RIS,  ['[']  = A_CSI
+    },
+    [S_ARG] = {
+        [0x00] = A_SKIP, [0x1b] = A_ESC,  [';']  = A_SEP,  ['?']  = A_QUES,
+        ['0']  = A_DIGIT, ['1'] = A_DIGIT, ['2'] = A_DIGIT, ['3'] = A_DIGIT,
+        ['4']  = A_DIGIT, ['5'] = A_DIGIT, ['6'] = A_DIGIT, ['7'] = A_DIGIT,
+        ['8']  = A_DIGIT, ['9'] = A_DIGIT,
+        ['A']  = A_CUU,  ['B']  = A_CUD,  ['C']  = A_CUF,  ['D']  = A_CUB,
+        ['E']  = A_CNL,  ['F']  = A_CPL,  ['G']  = A_CHA,  ['d']  = A_VPA,
+        ['H']  = A_CUP,  ['f']  = A_CUP,  ['I']  = A_CHT,  ['J']  = A_ED,
+        ['K']  = A_EL,   ['L']  = A_IL,   ['M']  = A_DL,   ['P']  = A_DCH,
+        ['S']  = A_SU,   ['T']  = A_SD,   ['X']  = A_ECH,  ['Z']  = A_CBT,
+        ['b']  = A_REP,  ['c']  = A_DA,   ['g']  = A_TBC,  ['m']  = A_SGR,
+        ['n']  = A_DSR,  ['h']  = A_SM,   ['i']  = A_MC,   ['l']  = A_RM,
+        ['s']  = A_SCP,  ['u']  = A_RCP,  ['@']  = A_ICH,  ['r']  = A_STBM
+    }
+};
+
 static bool
 handlechar(TMT *vt, char i)
 {
     COMMON_VARS;
 
-    char cs[] = {i, 0};
-    #define ON(S, C, A) if (vt->state == (S) && strchr(C, i)){ A; return true;}
-    #define DO(S, C, A) ON(S, C, consumearg(vt); if (!vt->ignored) {A;} \
-                                 fixcursor(vt); resetparser(vt););
-
-    DO(S_NUL, "\x07",       CB(vt, TMT_MSG_BELL, NULL))
-    DO(S_NUL, "\x08",       if (c->c) c->c--)
-    DO(S_NUL, "\x09",       while (++c->c < s->ncol - 1 && t[c->c].c != L'*'))
-    DO(S_NUL, "\x0a",       c->r < s->nline - 1? (void)c->r++ : scrup(vt, 0, 1))
-    DO(S_NUL, "\x0d",       c->c = 0)
-    ON(S_NUL, "\x1b",       vt->state = S_ESC)
-    ON(S_ESC, "\x1b",       vt->state = S_ESC)
-    DO(S_ESC, "H",          t[c->c].c = L'*')
-    DO(S_ESC, "7",          vt->oldcurs = vt->curs; vt->oldattrs = vt->attrs)
-    DO(S_ESC, "8",          vt->curs = vt->oldcurs; vt->attrs = vt->oldattrs)
-    ON(S_ESC, "+*()",       vt->ignored = true; vt->state = S_ARG)
-    DO(S_ESC, "c",          tmt_reset(vt))
-    ON(S_ESC, "[",          vt->state = S_ARG)
-    ON(S_ARG, "\x1b",       vt->state = S_ESC)
-    ON(S_ARG, ";",          consumearg(vt))
-    ON(S_ARG, "?",          (void)0)
-    ON(S_ARG, "0123456789", vt->arg = vt->arg * 10 + atoi(cs))
-    DO(S_ARG, "A",          c->r = MAX(c->r - P1(0), 0))
-    DO(S_ARG, "B",          c->r = MIN(c->r + P1(0), s->nline - 1))
-    DO(S_ARG, "C",          c->c = MIN(c->c + P1(0), s->ncol - 1))
-    DO(S_ARG, "D",          c->c = MIN(c->c - P1(0), c->c))
-    DO(S_ARG, "E",          c->c = 0; c->r = MIN(c->r + P1(0), s->nline - 1))
-    DO(S_ARG, "F",          c->c = 0; c->r = MAX(c->r - P1(0), 0))
-    DO(S_ARG, "G",          c->c = MIN(P1(0) - 1, s->ncol - 1))
-    DO(S_ARG, "d",          c->r = MIN(P1(0) - 1, s->nline - 1))
-    DO(S_ARG, "Hf",         c->r = P1(0) - 1; c->c = P1(1) - 1)
-    DO(S_ARG, "I",          while (++c->c < s->ncol - 1 && t[c->c].c != L'*'))
-    DO(S_ARG, "J",          ed(vt))
-    DO(S_ARG, "K",          el(vt))
-    DO(S_ARG, "L",          scrdn(vt, c->r, P1(0)))
-    DO(S_ARG, "M",          scrup(vt, c->r, P1(0)))
-    DO(S_ARG, "P",          dch(vt))
-    DO(S_ARG, "S",          scrup(vt, 0, P1(0)))
-    DO(S_ARG, "T",          scrdn(vt, 0, P1(0)))
-    DO(S_ARG, "X",          clearline(vt, l, c->c, P1(0)))
-    DO(S_ARG, "Z",          while (c->c && t[--c->c].c != L'*'))
-    DO(S_ARG, "b",          rep(vt));
-    DO(S_ARG, "c",          CB(vt, TMT_MSG_ANSWER, "\033[?6c"))
-    DO(S_ARG, "g",          if (P0(0) == 3) clearline(vt, vt->tabs, 0, s->ncol))
-    DO(S_ARG, "m",          sgr(vt))
-    DO(S_ARG, "n",          if (P0(0) == 6) dsr(vt))
-    DO(S_ARG, "h",          if (P0(0) == 25) CB(vt, TMT_MSG_CURSOR, "t"))
-    DO(S_ARG, "i",          (void)0)
-    DO(S_ARG, "l",          if (P0(0) == 25) CB(vt, TMT_MSG_CURSOR, "f"))
-    DO(S_ARG, "s",          vt->oldcurs = vt->curs; vt->oldattrs = vt->attrs)
-    DO(S_ARG, "u",          vt->curs = vt->oldcurs; vt->attrs = vt->oldattrs)
-    DO(S_ARG, "@",          ich(vt))
-
-    return resetparser(vt), false;
-}
-
-static void
-notify(TMT *vt, bool update, bool moved)
-{
-    if (update) CB(vt, TMT_MSG_UPDATE, &vt->screen);
-    if (moved) CB(vt, TMT_MSG_MOVED, &vt->curs);
-}
+    #define ON(A, X) case A: X; return true;
+    #define DO(A, X) case A: consumearg(vt); if (!vt->ignored) {X;} \
+                             COUNT(); fixcursor(vt); resetparser(vt); return true;
+    #ifdef TMT_STATS
+    #define COUNT() if (vt->state == S_ARG && !vt->ignored) \
+                        STAT(vt, csi[(unsigned char)i - '@'], 1)
+    #else
+    #define COUNT() (void)0
+    #endif
 
-static TMTLINE *
-allocline(TMT *vt, TMTLINE *o, size_t n, size_t pc)
-{
-    TMTLINE *l = realloc(o, sizeof(TMTLINE) + n * sizeof(TMTCHAR));
-    if (!l) return NULL;
+    switch (actions[vt->state][(unsigned char)i]){
+        ON(A_SKIP,  (void)0)
+        ON(A_ESC,   vt->state = S_ESC)
+        ON(A_IGN,   vt->ignored = true; vt->state = S_ARG)
+        ON(A_CSI,   vt->state = S_ARG)
+        ON(A_SEP,   consumearg(vt))
+        ON(A_QUES,  (void)0)
+        ON(A_DIGIT, vt->arg = vt->arg * 10 + (size_t)(i - '0'))
+        DO(A_BEL,   CB(vt, TMT_MSG_BELL, NULL))
+        DO(A_BS,    if (c->c) c->c--)
+        DO(A_HT,    while (++c->c < s->ncol - 1 && t[c->c].c != L'*'))
+        DO(A_LF,    linefeed(vt))
+        DO(A_CR,    c->c = 0)
+        DO(A_HTS,   t[c->c].c = L'*')
+        DO(A_SC,    vt->oldcurs = vt->curs; vt->oldattrs = vt->attrs)
+        DO(A_RC,    vt->curs = vt->oldcurs; vt->attrs = vt->oldattrs)
+        DO(A_RIS,   tmt_reset(vt))
+        DO(A_CUU,   c->r = MAX(c->r - P1(0), 0))
+        DO(A_CUD,   c->r = MIN(c->r + P1(0), s->nline - 1))
+        DO(A_CUF,   c->c = MIN(c->c + P1(0), s->ncol - 1))
+        DO(A_CUB,   c->c = MIN(c->c - P1(0), c->c))
+        DO(A_CNL,   c->c = 0; c->r = MIN(c->r + P1(0), s->nline - 1))
+        DO(A_CPL,   c->c = 0; c->r = MAX(c->r - P1(0), 0))
+        DO(A_CHA,   c->c = MIN(P1(0) - 1, s->ncol - 1))
+        DO(A_VPA,   c->r = MIN(P1(0) - 1, s->nline - 1))
+        DO(A_CUP,   c->r = P1(0) - 1; c->c = P1(1) - 1)
+        DO(A_CHT,   while (++c->c < s->ncol - 1 && t[c->c].c != L'*'))
+        DO(A_ED,    ed(vt))
+        DO(A_EL,    el(vt))
+        DO(A_IL,    scrdn(vt, c->r, P1(0)))
+        DO(A_DL,    scrup(vt, c->r, P1(0), false))
+        DO(A_DCH,   dch(vt))
+        DO(A_SU,    scrup(vt, vt->top, P1(0), true))
+        DO(A_SD,    scrdn(vt, vt->top, P1(0)))
+        DO(A_ECH,   clearline(vt, l, c->c, c->c + P1(0)))
+        DO(A_CBT,   while (c->c && t[--c->c].c != L'*'))
+        DO(A_REP,   rep(vt))
+        DO(A_DA,    CB(vt, TMT_MSG_ANSWER, "\033[?6c"))
+        DO(A_TBC,   if (P0(0) == 3) clearline(vt, vt->tabs, 0, s->ncol))
+        DO(A_SGR,   sgr(vt))
+        DO(A_DSR,   if (P0(0) == 6) dsr(vt))
+        DO(A_SM,    if (P0(0) == 25) CB(vt, TMT_MSG_CURSOR, "t"))
+        DO(A_MC,    (void)0)
+        DO(A_RM,    if (P0(0) == 25) CB(vt, TMT_MSG_CURSOR, "f"))
+        DO(A_SCP,   vt->oldcurs = vt->curs; vt->oldattrs = vt->attrs)
+        DO(A_RCP,   vt->curs = vt->oldcurs; vt->attrs = vt->oldattrs)
+        DO(A_ICH,   ich(vt))
+        DO(A_STBM,  stbm(vt))
+    }
 
-    clearline(vt, l, pc, n);
-    return l;
+    if (vt->state != S_NUL){
+        STAT(vt, unknown, 1);
+        resetparser(vt);
+    }
+    return false;
 }
 
-static void
-freelines(TMT *vt, size_t s, size_t n, bool screen)
+static size_t
+encode(wchar_t w, char *s, mbstate_t *ms)
 {
-    for (size_t i = s; vt->screen.lines && i < s + n; i++){
-        free(vt->screen.lines[i]);
-        vt->screen.lines[i] = NULL;
+    #ifdef TMT_UNICODE
+    unsigned long c = (unsigned long)w;
+    (void)ms;
+    if (c < 0x80) return *s = (char)c, 1;
+    if (c < 0x800){
+        s[0] = (char)(0xc0 | c >> 6);
+        s[1] = (char)(0x80 | (c & 0x3f));
+        return 2;
+    } else if (c < 0x10000){
+        s[0] = (char)(0xe0 | c >> 12);
+        s[1] = (char)(0x80 | (c >> 6 & 0x3f));
+        s[2] = (char)(0x80 | (c & 0x3f));
+        return 3;
     }
-    if (screen) free(vt->screen.lines);
+    s[0] = (char)(0xf0 | c >> 18);
+    s[1] = (char)(0x80 | (c >> 12 & 0x3f));
+    s[2] = (char)(0x80 | (c >> 6 & 0x3f));
+    s[3] = (char)(0x80 | (c & 0x3f));
+    return 4;
+    #else
+    size_t n = wcrtomb(s, w, ms);
+    if (n == (size_t)-1){
+        memset(ms, 0, sizeof(*ms));
+        return *s = '?', 1;
+    }
+    return n;
+    #endif
 }
 
-TMT *
-tmt_open(size_t nline, size_t ncol, TMTCALLBACK cb, void *p,
-         const wchar_t *acs)
+static size_t
+colafter(const TMT *vt, const TMTLINE *l, size_t b)
 {
-    TMT *vt = calloc(1, sizeof(TMT));
-    if (!nline || !ncol || !vt) return free(vt), NULL;
-
-    /* ASCII-safe defaults for box-drawing characters. */
-    vt->acschars = acs? acs : L"><^v#+:o##+++++~---_++++|<>*!fo";
-    vt->cb = cb;
-    vt->p = p;
-
-    if (!tmt_resize(vt, nline, ncol)) return tmt_close(vt), NULL;
-    return vt;
+    /* The column after the first b bytes of the text of l. */
+    char t[MB_LEN_MAX];
+    mbstate_t ms;
+    size_t n = 0, c = 0;
+    memset(&ms, 0, sizeof(ms));
+    for (; n < b && c < vt->screen.ncol; c++)
+        if (l->chars[c].c) n += encode(l->chars[c].c, t, &ms);
+    return c < vt->screen.ncol && !l->chars[c].c? c + 1 : c;
 }
 
-void
-tmt_close(TMT *vt)
+static bool
+search(const EXPECT *x, const char *t, size_t *s, size_t *e)
 {
-    free(vt->tabs);
-    freelines(vt, 0, vt->screen.nline, true);
-    free(vt);
+    #ifdef TMT_HAS_REGEX
+    regmatch_t m;
+    if (x->re){
+        if (regexec(x->re, t, 1, &m, 0)) return false;
+        *s = (size_t)m.rm_so;
+        *e = (size_t)m.rm_eo;
+        return true;
+    }
+    #endif
+    const char *p = strstr(t, x->s);
+    if (!p) return false;
+    *s = (size_t)(p - t);
+    *e = *s + strlen(x->s);
+    return true;
 }
 
-bool
-tmt_resize(TMT *vt, size_t nline, size_t ncol)
+static bool
+seen(const TEXT *t, const SEEN *m)
 {
-    if (nline < 2 || ncol < 2) return false;
-    if (nline < vt->screen.nline)
-        freelines(vt, nline, vt->screen.nline - nline, false);
+    for (size_t i = 0; i < t->nseen; i++)
+        if (t->seen[i].id == m->id && t->seen[i].s == m->s && t->seen[i].e == m->e)
+            return true;
+    return false;
+}
 
-    TMTLINE **l = realloc(vt->screen.lines, nline * sizeof(TMTLINE *));
-    if (!l) return false;
+static void
+expect(TMT *vt)
+{
+    /* Search the lines that have changed since they were last searched,
+     * reporting the first match of each pattern on each line unless it
+     * was reported there last time too.
+     */
+    for (size_t r = 0; r < vt->screen.nline; r++){
+        TMTLINE *l = vt->screen.lines[r];
+        if ((vt->store? vt->gens[r] : INFO(l)->gen) <= vt->sgen) continue;
+
+        TEXT *t = linetext(vt, r);
+        if (!t) return;
+        if (t->szseen < vt->npat){
+            SEEN *p = RESIZE(vt, t->seen, vt->npat * sizeof(SEEN));
+            if (!p) return;
+            t->seen = p;
+            t->szseen = vt->npat;
+        }
 
-    size_t pc = vt->screen.ncol;
-    vt->screen.lines = l;
-    vt->screen.ncol = ncol;
-    for (size_t i = 0; i < nline; i++){
-        TMTLINE *nl = NULL;
-        if (i >= vt->screen.nline)
-            nl = vt->screen.lines[i] = allocline(vt, NULL, ncol, 0);
-        else
-            nl = allocline(vt, vt->screen.lines[i], ncol, pc);
+        /* A prompt leaves the cursor after blanks that count, too. */
+        const char *x = t->s;
+        size_t c = MIN(vt->curs.c, vt->screen.ncol), b = c;
+        while (r == vt->curs.r && b && l->chars[b - 1].c == L' ')
+            b--;
+        for (size_t j = c; b < c && j < vt->screen.ncol; j++)
+            if (l->chars[j].c != L' ') b = c;
+        if (b < c){
+            if (vt->sztext < t->len + c - b + 1){
+                char *p = RESIZE(vt, vt->text, t->len + c - b + 1);
+                if (!p) return;
+                vt->text = p;
+                vt->sztext = t->len + c - b + 1;
+            }
+            memcpy(vt->text, t->s, t->len);
+            memset(vt->text + t->len, ' ', c - b);
+            vt->text[t->len + c - b] = 0;
+            x = vt->text;
+        }
 
-        if (!nl) return false;
-        vt->screen.lines[i] = nl;
+        SEEN now[vt->npat];
+        bool fresh[vt->npat];
+        size_t n = 0;
+        for (size_t i = 0, s, e; i < vt->npat; i++){
+            if (!search(&vt->pats[i], x, &s, &e)) continue;
+            now[n] = (SEEN){vt->pats[i].id, colafter(vt, l, s), colafter(vt, l, e)};
+            fresh[n] = !seen(t, &now[n]);
+            n++;
+        }
+        memcpy(t->seen, now, n * sizeof(SEEN));
+        t->nseen = n;
+
+        for (size_t i = 0; i < n; i++){
+            TMTMATCH m = {now[i].id, r, now[i].s, now[i].e};
+            if (!fresh[i]) continue;
+            if (vt->want){
+                *vt->want = m;
+                vt->want = NULL;
+            }
+            CB(vt, TMT_MSG_MATCH, &m);
+        }
     }
-    vt->screen.nline = nline;
-
-    vt->tabs = allocline(vt, vt->tabs, ncol, 0);
-    if (!vt->tabs) return free(l), false;
-    vt->tabs->chars[0].c = vt->tabs->chars[ncol - 1].c = L'*';
-    for (size_t i = 0; i < ncol; i++) if (i % TAB == 0)
-        vt->tabs->chars[i].c = L'*';
-
-    fixcursor(vt);
-    dirtylines(vt, 0, nline);
-    notify(vt, true, true);
-    return true;
+    vt->sgen = vt->gen;
 }
 
 static void
-writecharatcurs(TMT *vt, wchar_t w)
+notify(TMT *vt, bool update, bool moved)
 {
-    COMMON_VARS;
+    if (vt->batch) return;
+    for (size_t i = vt->moved; i < vt->movede; i++)
+        vt->screen.lines[i]->dirty = true;
+    vt->moved = SIZE_MAX;
+    vt->movede = 0;
 
-    #ifdef TMT_HAS_WCWIDTH
-    extern int wcwidth(wchar_t c);
-    if (wcwidth(w) > 1)  w = TMT_INVALID_CHAR;
-    if (wcwidth(w) < 0) return;
-    #endif
+    if (update && vt->npat) expect(vt);
+    if ((update || moved) && vt->cb) fillblanks(vt);
+    if (update) CB(vt, TMT_MSG_UPDATE, &vt->screen);
+    if (moved) CB(vt, TMT_MSG_MOVED, &vt->curs);
+}
 
-    CLINE(vt)->chars[vt->curs.c].c = w;
-    CLINE(vt)->chars[vt->curs.c].a = vt->attrs;
-    CLINE(vt)->dirty = vt->dirty = true;
+static void *stdalloc(void *p, size_t n)            { (void)p; return malloc(n);     }
+static void *stdresize(void *p, void *o, size_t n)  { (void)p; return realloc(o, n); }
+static void  stdrelease(void *p, void *o)           { (void)p; free(o);              }
+static const TMTALLOC stdmem = {stdalloc, stdresize, stdrelease, NULL};
 
-    if (c->c < s->ncol - 1)
-        c->c++;
-    else{
-        c->c = 0;
-        c->r++;
-    }
+static size_t
+aligned(size_t n)
+{
+    return (n + sizeof(LINEINFO) - 1) / sizeof(LINEINFO) * sizeof(LINEINFO);
+}
 
-    if (c->r >= s->nline){
-        c->r = s->nline - 1;
-        scrup(vt, 0, 1);
-    }
+static size_t
+slaboffset(size_t nline, size_t ncol, size_t i)
+{
+    /* The screen is a single slab holding the ring, then the lazy list,
+     * then the tab stops, then each line, each preceded by its LINEINFO.
+     */
+    return aligned(3 * nline * sizeof(TMTLINE *))
+         + i * aligned(sizeof(LINEINFO) + sizeof(TMTLINE)
+                       + ncol * sizeof(TMTCHAR));
 }
 
-static inline size_t
-testmbchar(TMT *vt)
+static TMTLINE *
+slabline(void *slab, size_t nline, size_t ncol, size_t i)
 {
-    mbstate_t ts = vt->ms;
-    return vt->nmb? mbrtowc(NULL, vt->mb, vt->nmb, &ts) : (size_t)-2;
+    LINEINFO *l = (LINEINFO *)((char *)slab + slaboffset(nline, ncol, i));
+    memset(l, 0, sizeof(LINEINFO));
+    l->blank = SIZE_MAX;
+    return (TMTLINE *)(l + 1);
 }
 
-static inline wchar_t
-getmbchar(TMT *vt)
+static size_t
+place(const TMT *vt, const TMTLINE *l)
 {
-    wchar_t c = 0;
-    size_t n = mbrtowc(&c, vt->mb, vt->nmb, &vt->ms);
+    size_t nline = vt->capline, ncol = vt->capcol;
+    size_t o = (size_t)((char *)INFO(l) - (char *)vt->slab);
+    return (o - slaboffset(nline, ncol, 1))
+         / (slaboffset(nline, ncol, 2) - slaboffset(nline, ncol, 1));
+}
+
+static size_t
+slot(const TMT *vt, size_t r)
+{
+    /* Lines keep their places in the slab as they scroll, and their text
+     * is kept by place; a compacted terminal's is kept by row, which is
+     * the same place once it has its own slab again.
+     */
+    return vt->store? r : place(vt, vt->screen.lines[r]);
+}
+
+static void
+forget(TMT *vt, const TMTLINE *l)
+{
+    /* A line written afresh has had no matches reported on it. */
+    if (vt->texts && !vt->store)
+        vt->texts[place(vt, l)].nseen = 0;
+}
+
+static TEXT *
+linetext(TMT *vt, size_t r)
+{
+    /* The text of line r, less trailing blanks, brought up to date. */
+    fillblanks(vt);
+    size_t ncol = vt->screen.ncol, n = 0, e = ncol;
+    const TMTLINE *l = vt->screen.lines[r];
+    uint64_t gen = vt->store? vt->gens[r] : INFO(l)->gen;
+    if (!vt->texts){
+        if (!(vt->texts = ALLOC(vt, vt->capline * sizeof(TEXT)))) return NULL;
+        memset(vt->texts, 0, vt->capline * sizeof(TEXT));
+    }
+    TEXT *t = vt->texts + slot(vt, r);
+    if (t->s && t->gen == gen) return t;
+
+    if (vt->sztext < ncol * MB_LEN_MAX + 1){
+        char *s = RESIZE(vt, vt->text, ncol * MB_LEN_MAX + 1);
+        if (!s) return NULL;
+        vt->text = s;
+        vt->sztext = ncol * MB_LEN_MAX + 1;
+    }
+    mbstate_t ms;
+    memset(&ms, 0, sizeof(ms));
+    while (e && l->chars[e - 1].c == L' ')
+        e--;
+    for (size_t c = 0; c < e; c++)
+        if (l->chars[c].c) n += encode(l->chars[c].c, vt->text + n, &ms);
+
+    if (t->size <= n){
+        char *s = RESIZE(vt, t->s, n + 1);
+        if (!s) return NULL;
+        t->s = s;
+        t->size = n + 1;
+    }
+    memcpy(t->s, vt->text, n);
+    t->s[n] = 0;
+    t->len = n;
+    t->gen = gen;
+    return t;
+}
+
+static void
+droptext(TMT *vt, TEXT *t)
+{
+    RELEASE(vt, t->s);
+    RELEASE(vt, t->seen);
+    memset(t, 0, sizeof(TEXT));
+}
+
+static void
+droptexts(TMT *vt)
+{
+    for (size_t i = 0; vt->texts && i < vt->screen.nline; i++)
+        droptext(vt, &vt->texts[i]);
+    RELEASE(vt, vt->texts);
+    vt->texts = NULL;
+}
+
+static size_t
+hashline(const TMTLINE *l, size_t ncol)
+{
+    /* FNV-1a over each cell's character and packed attributes. */
+    uint64_t h = 14695981039346656037u;
+    for (size_t i = 0; i < ncol; i++){
+        uint64_t v = (uint32_t)l->chars[i].c
+                   | (uint64_t)packattrs(l->chars[i].a) << 32;
+        for (int j = 0; j < 64; j += 8)
+            h = (h ^ (v >> j & 0xff)) * 1099511628211u;
+    }
+    return (size_t)h;
+}
+
+static void
+rehash(TMTSTORE *s)
+{
+    /* If there's no memory for more buckets, the chains just get longer. */
+    size_t n = s->nbucket? s->nbucket * 2 : 64;
+    SHARED **b = s->mem.alloc(s->mem.p, n * sizeof(SHARED *));
+    if (!b) return;
+
+    for (size_t i = 0; i < n; i++)
+        b[i] = NULL;
+    for (size_t i = 0; i < s->nbucket; i++){
+        for (SHARED *h = s->buckets[i], *next; h; h = next){
+            next = h->next;
+            h->next = b[h->hash % n];
+            b[h->hash % n] = h;
+        }
+    }
+    if (s->buckets)
+        s->mem.release(s->mem.p, s->buckets);
+    s->buckets = b;
+    s->nbucket = n;
+}
+
+static TMTLINE *
+intern(TMTSTORE *s, const TMTLINE *l, size_t ncol)
+{
+    /* The shared line just like l, made if there isn't one yet. */
+    size_t hash = hashline(l, ncol), n = ncol * sizeof(TMTCHAR);
+    if (s->nline >= s->nbucket)
+        rehash(s);
+    if (!s->nbucket) return NULL;
+
+    SHARED **b = &s->buckets[hash % s->nbucket];
+    for (SHARED *h = *b; h; h = h->next){
+        if (h->hash == hash && h->ncol == ncol && h->info.wrap == INFO(l)->wrap
+            && samecells(SHAREDLINE(h)->chars, l->chars, ncol))
+            return h->refs++, SHAREDLINE(h);
+    }
+
+    SHARED *h = s->mem.alloc(s->mem.p, sizeof(SHARED) + sizeof(TMTLINE) + n);
+    if (!h) return NULL;
+    h->refs = 1;
+    h->hash = hash;
+    h->ncol = ncol;
+    h->info = *INFO(l);
+    h->info.ds = h->info.de = h->info.gen = 0;
+    SHAREDLINE(h)->dirty = false;
+    memcpy(SHAREDLINE(h)->chars, l->chars, n);
+    h->next = *b;
+    *b = h;
+    s->nline++;
+    return SHAREDLINE(h);
+}
+
+static void
+unshare(TMTSTORE *s, TMTLINE *l)
+{
+    SHARED *h = LINESHARED(l);
+    if (--h->refs) return;
+
+    SHARED **p = &s->buckets[h->hash % s->nbucket];
+    while (*p != h)
+        p = &(*p)->next;
+    *p = h->next;
+    s->nline--;
+    s->mem.release(s->mem.p, h);
+}
+
+static void
+unshareall(TMT *vt)
+{
+    for (size_t i = 0; i < vt->screen.nline; i++)
+        unshare(vt->store, vt->screen.lines[i]);
+    unshare(vt->store, vt->tabs);
+}
+
+static bool
+thaw(TMT *vt)
+{
+    /* Give a compacted terminal its own copy of its lines again. */
+    if (!vt->store) return true;
+
+    size_t nline = vt->screen.nline, ncol = vt->screen.ncol;
+    size_t n = sizeof(TMTLINE) + ncol * sizeof(TMTCHAR);
+    void *slab = ALLOC(vt, slaboffset(nline, ncol, nline + 1));
+    if (!slab) return false;
+
+    TMTLINE **l = slab, *t = slabline(slab, nline, ncol, 0);
+    for (size_t i = 0; i < nline; i++){
+        l[i] = l[i + nline] = slabline(slab, nline, ncol, i + 1);
+        *INFO(l[i]) = *INFO(vt->screen.lines[i]);
+        INFO(l[i])->gen = vt->gens[i];
+        memcpy(l[i], vt->screen.lines[i], n);
+    }
+    *INFO(t) = *INFO(vt->tabs);
+    memcpy(t, vt->tabs, n);
+
+    unshareall(vt);
+    RELEASE(vt, vt->slab);
+    vt->slab = slab;
+    vt->ring = vt->screen.lines = l;
+    vt->lazy = l + 2 * nline;
+    vt->tabs = t;
+    vt->base = 0;
+    vt->capline = nline;
+    vt->capcol = ncol;
+    vt->store = NULL;
+    vt->gens = NULL;
+    return true;
+}
+
+TMT *
+tmt_open(size_t nline, size_t ncol, TMTCALLBACK cb, void *p,
+         const wchar_t *acs)
+{
+    return tmt_open_alloc(nline, ncol, cb, p, acs, NULL);
+}
+
+TMT *
+tmt_open_alloc(size_t nline, size_t ncol, TMTCALLBACK cb, void *p,
+               const wchar_t *acs, const TMTALLOC *mem)
+{
+    mem = mem? mem : &stdmem;
+
+    TMT *vt = mem->alloc(mem->p, sizeof(TMT));
+    if (!vt) return NULL;
+    memset(vt, 0, sizeof(TMT));
+    vt->mem = *mem;
+    if (!nline || !ncol) return RELEASE(vt, vt), NULL;
+
+    /* ASCII-safe defaults for box-drawing characters. */
+    vt->acschars = acs? acs : L"><^v#+:o##+++++~---_++++|<>*!fo";
+    vt->cb = cb;
+    vt->p = p;
+    vt->attrs = vt->oldattrs = defattrs;
+    #ifdef TMT_PUBLISH
+    vt->back = 0, vt->last = 1, vt->front = 2;
+    atomic_init(&vt->mid, 1);
+    #endif
+
+    if (!tmt_resize(vt, nline, ncol)) return tmt_close(vt), NULL;
+    return vt;
+}
+
+void
+tmt_close(TMT *vt)
+{
+    if (vt->store)
+        unshareall(vt);
+    while (vt->npat)
+        unexpect(vt, &vt->pats[--vt->npat]);
+    RELEASE(vt, vt->pats);
+    droptexts(vt);
+    RELEASE(vt, vt->text);
+    RELEASE(vt, vt->rows);
+    RELEASE(vt, vt->rgb);
+    RELEASE(vt, vt->inbuf);
+    tmt_set_history(vt, 0);
+    #ifdef TMT_PUBLISH
+    for (size_t i = 0; i < 3; i++)
+        RELEASE(vt, vt->frames[i]);
+    #endif
+    RELEASE(vt, vt->slab);
+    RELEASE(vt, vt);
+}
+
+static bool
+blanks(const TMTCHAR *c, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        if (!samecells(c + i, &blankchar, 1)) return false;
+    return true;
+}
+
+static TMTLINE *
+startrow(TMT *vt, const REFLOW *f, size_t nr)
+{
+    /* The line to put new row nr together in, if any.  Rows bound for
+     * the history borrow the first row's line on their way there.
+     */
+    size_t nline = vt->screen.nline, r = nr < f->skip? 0 : nr - f->skip;
+    if (f->skip == SIZE_MAX || r >= nline || (nr < f->skip && !vt->hmax))
+        return NULL;
+
+    TMTLINE *l = slabline(vt->slab, vt->capline, vt->capcol, r + 1);
+    vt->ring[r] = vt->ring[r + nline] = l;
+    styled(l, defattrs, true);
+    return l;
+}
+
+static void
+endrow(TMT *vt, TMTLINE *l, const REFLOW *f, size_t nr, size_t n, size_t wrap)
+{
+    /* Blank the rest of new row nr after its first n cells.  If the old
+     * row in its place looked just the same, it keeps its damage and
+     * generation; otherwise all of it is damaged.
+     */
+    size_t ncol = vt->screen.ncol, pc = f->ncol, m = MIN(ncol, pc);
+    for (size_t i = n; i < ncol; i++)
+        l->chars[i] = blankchar;
+    if (n < ncol)
+        styled(l, defattrs, false);
+    INFO(l)->wrap = wrap;
+    if (nr < f->skip){
+        histpush(vt, l);
+        return;
+    }
+
+    size_t r = nr - f->skip;
+    const TMTCHAR *p = f->cells + MIN(r, f->nline) * pc;
+    l->dirty = false;
+    if (r < f->nline && samecells(l->chars, p, m)
+        && blanks(l->chars + m, MAX(n, m) - m) && f->rows[r].len <= m){
+        LINEINFO *i = INFO(l), k = *i;
+        *i = f->rows[r].info;
+        i->a = k.a;
+        i->mixed = k.mixed;
+        i->wrap = wrap;
+        i->de = MIN(i->de, ncol);
+        l->dirty = f->rows[r].dirty;
+    } else{
+        damage(vt, l, 0, ncol);
+        forget(vt, l);
+    }
+}
+
+static size_t
+reflow(TMT *vt, REFLOW *f)
+{
+    /* Join up the old rows that were wrapped onto the next, and wrap
+     * them again at the new width, a row's worth of cells at a time.
+     * Trailing blanks are left off, but not the cell under the cursor.
+     * Returns how many rows it took.
+     */
+    size_t ncol = vt->screen.ncol, pc = f->ncol, nr = 0;
+    for (size_t a = 0, b; a < f->nline; a = b + 1, nr++){
+        for (b = a; b + 1 < f->nline && f->rows[b].info.wrap; b++)
+            ;
+        size_t col = 0;
+        TMTLINE *l = startrow(vt, f, nr);
+        for (size_t j = a; j <= b; j++){
+            const ROW *o = f->rows + j;
+            const TMTCHAR *p = f->cells + j * pc;
+            size_t n = j < b? MIN(o->info.wrap, pc) : o->len;
+            if (j == f->from.r)
+                n = MAX(n, f->from.c + 1);
+
+            for (size_t i = 0, k; i < n; i += k){
+                k = MIN(n - i, ncol - col);
+                if (k && k < n - i && !p[i + k].c)
+                    k--; /* don't split a double-width character */
+                if (!k){
+                    if (l) endrow(vt, l, f, nr, col, col);
+                    l = startrow(vt, f, ++nr);
+                    col = 0;
+                    continue;
+                }
+                if (j == f->from.r && f->from.c >= i && f->from.c < i + k){
+                    f->to.r = nr;
+                    f->to.c = col + f->from.c - i;
+                }
+                if (l){
+                    memcpy(l->chars + col, p + i, k * sizeof(TMTCHAR));
+                    if (!o->info.mixed)
+                        styled(l, o->info.a, false);
+                    else for (size_t x = i; x < i + k; x++)
+                        styled(l, p[x].a, false);
+                }
+                col += k;
+            }
+        }
+        if (l) endrow(vt, l, f, nr, col, 0);
+    }
+    return nr;
+}
+
+static size_t
+trimmed(const TMTLINE *l, size_t n)
+{
+    /* How many of the first n cells of l are left without trailing blanks. */
+    n = MIN(n, INFO(l)->blank);
+    while (n && blanks(l->chars + n - 1, 1))
+        n--;
+    return n;
+}
+
+static bool
+fits(const TMT *vt, size_t nline, size_t ncol)
+{
+    /* Whether the slab has room for a screen this size without most of
+     * it going unused.
+     */
+    size_t cl = vt->capline, cc = vt->capcol;
+    return nline <= cl && ncol <= cc
+        && 2 * slaboffset(nline, ncol, nline + 1) >= slaboffset(cl, cc, cl + 1);
+}
+
+static bool
+inplace(TMT *vt, size_t nline, size_t ncol)
+{
+    /* If no line is wrapped or needs to be, and the cursor stays where
+     * it is, every row can stay where it is too.  The screen's lines
+     * must be the first nline in the slab, though, so any that aren't
+     * change places with rows being dropped off the bottom.
+     */
+    size_t pn = vt->screen.nline, pc = vt->screen.ncol, nd = 0;
+    if (vt->curs.r >= nline || vt->curs.c >= ncol) return false;
+    for (size_t i = 0; i < pn; i++){
+        TMTLINE *l = vt->screen.lines[i];
+        if (INFO(l)->wrap || trimmed(l, pc) > ncol) return false;
+    }
+
+    fillblanks(vt);
+    TMTLINE *k[pn], *drop[pn];
+    for (size_t i = 0; i < pn; i++){
+        k[i] = vt->screen.lines[i];
+        k[i]->dirty |= i >= vt->moved && i < vt->movede;
+        if (i >= nline && place(vt, k[i]) < nline)
+            drop[nd++] = k[i];
+    }
+    for (size_t i = 0; i < MIN(pn, nline); i++){
+        size_t p = place(vt, k[i]);
+        if (p < nline) continue;
+
+        TMTLINE *d = drop[--nd];
+        *INFO(d) = *INFO(k[i]);
+        memcpy(d, k[i], sizeof(TMTLINE) + pc * sizeof(TMTCHAR));
+        if (vt->texts){
+            TEXT t = vt->texts[p];
+            vt->texts[p] = vt->texts[place(vt, d)];
+            vt->texts[place(vt, d)] = t;
+        }
+        k[i] = d;
+    }
+    for (size_t i = nline; vt->texts && i < pn; i++)
+        droptext(vt, &vt->texts[i]);
+
+    vt->ring = vt->screen.lines = vt->slab;
+    vt->lazy = vt->ring + 2 * nline;
+    vt->base = 0;
+    vt->screen.nline = nline;
+    vt->screen.ncol = ncol;
+    for (size_t i = 0; i < nline; i++){
+        TMTLINE *l = i < pn? k[i] : slabline(vt->slab, vt->capline, vt->capcol, i + 1);
+        vt->ring[i] = vt->ring[i + nline] = l;
+        if (i >= pn){
+            clearline(vt, l, 0, ncol);
+            continue;
+        }
+        INFO(l)->de = MIN(INFO(l)->de, ncol);
+        for (size_t c = pc; c < ncol; c++)
+            l->chars[c] = blankchar;
+        if (ncol > pc)
+            styled(l, defattrs, false);
+    }
+    return true;
+}
+
+static bool
+rewrap(TMT *vt, size_t nline, size_t ncol)
+{
+    /* Copy the old screen aside and rewrap it into the slab, or into a
+     * new one, leaving room to grow, if it doesn't fit.
+     */
+    size_t pn = vt->screen.nline, pc = vt->screen.ncol;
+    size_t cl = vt->capline, cc = vt->capcol;
+    size_t sz = pn * (sizeof(ROW) + pc * sizeof(TMTCHAR));
+    if (sz > vt->szrows){
+        ROW *r = RESIZE(vt, vt->rows, sz);
+        if (!r) return false;
+        vt->rows = r;
+        vt->szrows = sz;
+    }
+
+    void *slab = vt->slab;
+    if (!fits(vt, nline, ncol)){
+        cl = slab && nline > cl? nline + nline / 4 : nline;
+        cc = slab && ncol > cc? ncol + ncol / 4 : ncol;
+        if (!(slab = ALLOC(vt, slaboffset(cl, cc, cl + 1)))) return false;
+    }
+
+    ROW *o = vt->rows;
+    TMTCHAR *cells = (TMTCHAR *)(o + pn);
+    for (size_t i = 0; i < pn; i++)
+        o[i].len = trimmed(vt->screen.lines[i], pc);
+
+    fillblanks(vt);
+    for (size_t i = 0; i < pn; i++){
+        TMTLINE *l = vt->screen.lines[i];
+        memset(&o[i].text, 0, sizeof(TEXT));
+        if (vt->texts)
+            o[i].text = vt->texts[slot(vt, i)];
+        o[i].info = *INFO(l);
+        o[i].dirty = l->dirty || (i >= vt->moved && i < vt->movede);
+        memcpy(cells + i * pc, l->chars, pc * sizeof(TMTCHAR));
+    }
+
+    /* Row i's text and matches go with it to place i, where the rows
+     * that end up just as they were will be.
+     */
+    bool same = slab == vt->slab;
+    if (!same){
+        TEXT *t = vt->texts? ALLOC(vt, cl * sizeof(TEXT)) : NULL;
+        if (t) memset(t, 0, cl * sizeof(TEXT));
+        RELEASE(vt, vt->texts);
+        vt->texts = t;
+        RELEASE(vt, vt->slab);
+        vt->slab = slab;
+        vt->capline = cl;
+        vt->capcol = cc;
+    }
+    for (size_t i = 0; i < pn; i++){
+        if (vt->texts && i < nline)
+            vt->texts[i] = o[i].text;
+        else{
+            droptext(vt, &o[i].text);
+            if (vt->texts && same)
+                memset(&vt->texts[i], 0, sizeof(TEXT));
+        }
+    }
+
+    REFLOW f = {o, cells, pn, pc, SIZE_MAX, vt->curs, {0, 0}};
+    vt->ring = vt->screen.lines = slab;
+    vt->lazy = vt->ring + 2 * nline;
+    vt->base = 0;
+    vt->screen.nline = nline;
+    vt->screen.ncol = ncol;
+    reflow(vt, &f);
+    f.skip = f.to.r >= nline? f.to.r + 1 - nline : 0;
+    size_t n = reflow(vt, &f);
+    for (size_t r = n > f.skip? n - f.skip : 0; r < nline; r++)
+        endrow(vt, startrow(vt, &f, r + f.skip), &f, r + f.skip, 0, 0);
+
+    vt->curs.r = f.to.r - f.skip;
+    vt->curs.c = f.to.c;
+    return true;
+}
+
+bool
+tmt_resize(TMT *vt, size_t nline, size_t ncol)
+{
+    /* Lines that were wrapped are joined up again and rewrapped to the
+     * new width, keeping the cursor on the screen by pushing rows into
+     * the history if need be.  Rows that end up just as they were keep
+     * their damage.
+     */
+    if (nline < 2 || ncol < 2 || nline > SIZE_MAX / 4 / sizeof(TMTCHAR) / ncol
+        || !thaw(vt))
+        return false;
+    if (!(fits(vt, nline, ncol) && inplace(vt, nline, ncol))
+        && !rewrap(vt, nline, ncol))
+        return false;
+
+    vt->top = 0;
+    vt->bot = nline;
+    vt->moved = SIZE_MAX;
+    vt->movede = 0;
+
+    vt->tabs = slabline(vt->slab, vt->capline, vt->capcol, 0);
+    clearline(vt, vt->tabs, 0, ncol);
+    vt->tabs->chars[0].c = vt->tabs->chars[ncol - 1].c = L'*';
+    for (size_t i = 0; i < ncol; i++) if (i % TAB == 0)
+        vt->tabs->chars[i].c = L'*';
+
+    fixcursor(vt);
+    STAT(vt, resizes, 1);
+    notify(vt, true, true);
+    return true;
+}
+
+static int
+width(wchar_t w)
+{
+    /* How many columns w takes up, or -1 if it isn't printed at all. */
+    #if defined(TMT_UNICODE)
+    static const signed char widths[] = {1, 2, 0, -1};
+    uint_least32_t u = (uint_least32_t)w;
+    if (u >= 0x110000) return 1;
+    return widths[widthblocks[widthindex[u >> 8]][(u & 0xff) >> 2] >> (u & 3) * 2 & 3];
+    #elif defined(TMT_HAS_WCWIDTH)
+    extern int wcwidth(wchar_t c);
+    return wcwidth(w);
+    #else
+    return 1;
+    #endif
+}
+
+static void
+wrap(TMT *vt)
+{
+    /* Remember that the line goes on in the next, unless it didn't move. */
+    TMTLINE *l = CLINE(vt);
+    size_t c = MIN(vt->curs.c, vt->screen.ncol);
+    vt->curs.c = 0;
+    linefeed(vt);
+    INFO(l)->wrap = CLINE(vt) != l? c : 0;
+}
+
+static void
+writecharatcurs(TMT *vt, wchar_t w)
+{
+    /* A double-width character takes up its cell and the one after,
+     * which holds a zero; it goes on the next line if there's no room.
+     */
+    COMMON_VARS;
+    int n = width(w);
+    if (n <= 0) return;
+
+    if (c->c + (size_t)n > s->ncol){
+        clearline(vt, l, c->c, s->ncol);
+        wrap(vt);
+        l = CLINE(vt);
+    }
+
+    splitwide(vt, l, c->c, c->c + n);
+    solid(l, c->c, c->c + n);
+    l->chars[c->c].c = w;
+    l->chars[c->c].a = vt->attrs;
+    if (n > 1){
+        l->chars[c->c + 1].c = 0;
+        l->chars[c->c + 1].a = vt->attrs;
+    }
+    styled(l, vt->attrs, false);
+    damage(vt, l, c->c, c->c + n);
+    STAT(vt, chars, 1);
+
+    if ((c->c += n) >= s->ncol)
+        wrap(vt);
+}
+
+#ifdef TMT_UTF8
+/* A UTF-8 decoder in the form of a DFA over byte classes: ASCII, the
+ * three continuation byte ranges that matter for overlong and surrogate
+ * checks, never-valid bytes, and the various lead bytes. Each state
+ * names what the next byte must be.
+ */
+enum{U8_ACCEPT, U8_C1, U8_C2, U8_C3, U8_E0, U8_ED, U8_F0, U8_F4, U8_REJECT};
+
+static const unsigned char u8class[UCHAR_MAX + 1] = {
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,  1,
+     2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,  2,
+     3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,
+     3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,  3,
+     4,  4,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,
+     5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,  5,
+     6,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  7,  8,  7,  7,
+     9, 10, 10, 10, 11,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4,  4
+};
+
+static const unsigned char u8mask[] = {0x7f, 0, 0, 0, 0, 0x1f,
+                                       0x0f, 0x0f, 0x0f, 0x07, 0x07, 0x07};
+
+#define R U8_REJECT
+static const unsigned char u8next[][sizeof(u8mask)] = {
+    [U8_ACCEPT] = {U8_ACCEPT, R, R, R, R, U8_C1, U8_E0, U8_C2, U8_ED,
+                   U8_F0, U8_C3, U8_F4},
+    [U8_C1]     = {R, U8_ACCEPT, U8_ACCEPT, U8_ACCEPT, R, R, R, R, R, R, R, R},
+    [U8_C2]     = {R, U8_C1, U8_C1, U8_C1, R, R, R, R, R, R, R, R},
+    [U8_C3]     = {R, U8_C2, U8_C2, U8_C2, R, R, R, R, R, R, R, R},
+    [U8_E0]     = {R, R, R, U8_C1, R, R, R, R, R, R, R, R},
+    [U8_ED]     = {R, U8_C1, U8_C1, R, R, R, R, R, R, R, R, R},
+    [U8_F0]     = {R, R, U8_C2, U8_C2, R, R, R, R, R, R, R, R},
+    [U8_F4]     = {R, U8_C2, R, R, R, R, R, R, R, R, R, R}
+};
+#undef R
+
+static void
+decodeu8(TMT *vt, unsigned char b)
+{
+    unsigned char k = u8class[b];
+    unsigned char n = u8next[vt->u8s][k];
+
+    if (n == U8_REJECT){
+        /* A byte that cuts a sequence short may start the next one. */
+        bool again = vt->u8s != U8_ACCEPT;
+        vt->u8s = U8_ACCEPT;
+        writecharatcurs(vt, TMT_INVALID_CHAR);
+        if (again) decodeu8(vt, b);
+        return;
+    }
+
+    if (vt->u8s == U8_ACCEPT)
+        vt->u8c = (wchar_t)(b & u8mask[k]);
+    else
+        vt->u8c = (wchar_t)(((uint32_t)vt->u8c << 6) | (b & 0x3fU));
+
+    vt->u8s = n;
+    if (n == U8_ACCEPT)
+        writecharatcurs(vt, vt->u8c);
+}
+#else
+static inline size_t
+testmbchar(TMT *vt)
+{
+    mbstate_t ts = vt->ms;
+    return vt->nmb? mbrtowc(NULL, vt->mb, vt->nmb, &ts) : (size_t)-2;
+}
+
+static inline wchar_t
+getmbchar(TMT *vt)
+{
+    wchar_t c = 0;
+    size_t n = mbrtowc(&c, vt->mb, vt->nmb, &vt->ms);
     vt->nmb = 0;
     return (n == (size_t)-1 || n == (size_t)-2)? TMT_INVALID_CHAR : c;
 }
+#endif
 
-void
-tmt_write(TMT *vt, const char *s, size_t n)
+static size_t
+asciispan(const char *s, size_t n)
 {
-    TMTPOINT oc = vt->curs;
-    n = n? n : strlen(s);
+    /* Count the leading bytes of s that are printable ASCII, eight at a
+     * time while we can. Once no byte has its high bit set, adding 0x60
+     * sets the high bit of every byte >= 0x20 and adding 0x01 sets it
+     * only for 0x7f, without carries between bytes.
+     */
+    const uint64_t ones = 0x0101010101010101ULL, high = ones * 0x80;
+    size_t i = 0;
+
+    for (uint64_t w; i + sizeof(w) <= n; i += sizeof(w)){
+        memcpy(&w, s + i, sizeof(w));
+        if ((w & high) || ((w + ones * 0x60) & high) != high
+                       || ((w + ones) & high))
+            break;
+    }
+    while (i < n && (unsigned char)s[i] >= 0x20 && (unsigned char)s[i] < 0x7f)
+        i++;
+    return i;
+}
+
+static size_t
+writeascii(TMT *vt, const char *s, size_t n)
+{
+    /* Store a run of printable ASCII directly into the current line.
+     * The last column is left to writecharatcurs(), which knows how
+     * to wrap and scroll.
+     */
+    TMTLINE *l = CLINE(vt);
+    size_t c = vt->curs.c;
+
+    n = asciispan(s, MIN(n, vt->screen.ncol - 1 - c));
+    if (n){
+        splitwide(vt, l, c, c + n);
+        solid(l, c, c + n);
+    }
+    for (size_t i = 0; i < n; i++){
+        l->chars[c + i].c = (wchar_t)s[i];
+        l->chars[c + i].a = vt->attrs;
+    }
+
+    if (n){
+        styled(l, vt->attrs, false);
+        damage(vt, l, c, c + n);
+        STAT(vt, chars, n);
+        vt->curs.c += n;
+    }
+    return n;
+}
+
+static void
+parse(TMT *vt, const char *s, size_t n)
+{
+    /* All parser state lives in vt, so input can be split anywhere,
+     * even in the middle of an escape sequence or multibyte character.
+     */
+    STAT(vt, bytes, n);
 
     for (size_t p = 0; p < n; p++){
-        if (handlechar(vt, s[p]))
+        size_t k = 0;
+        if (vt->state == S_NUL && !vt->acs && MBIDLE(vt))
+            k = writeascii(vt, s + p, n - p);
+
+        if (k)
+            p += k - 1;
+        else if (handlechar(vt, s[p]))
             continue;
         else if (vt->acs)
             writecharatcurs(vt, tacs(vt, (unsigned char)s[p]));
+        #ifdef TMT_UTF8
+        else
+            decodeu8(vt, (unsigned char)s[p]);
+        #else
         else if (vt->nmb >= BUF_MAX)
             writecharatcurs(vt, getmbchar(vt));
         else{
@@ -468,14 +1931,70 @@ tmt_write(TMT *vt, const char *s, size_t n)
             if (testmbchar(vt) <= MB_LEN_MAX)
                 writecharatcurs(vt, getmbchar(vt));
         }
+        #endif
     }
+}
+
+void
+tmt_write(TMT *vt, const char *s, size_t n)
+{
+    TMTPOINT oc = vt->curs;
+    if (!thaw(vt)) return;
+    parse(vt, s, n? n : strlen(s));
+    notify(vt, vt->dirty, memcmp(&oc, &vt->curs, sizeof(oc)) != 0);
+}
 
+#ifdef TMT_HAS_IOVEC
+void
+tmt_writev(TMT *vt, const struct iovec *iov, int n)
+{
+    TMTPOINT oc = vt->curs;
+    if (!thaw(vt)) return;
+    for (int i = 0; i < n; i++)
+        parse(vt, iov[i].iov_base, iov[i].iov_len);
     notify(vt, vt->dirty, memcmp(&oc, &vt->curs, sizeof(oc)) != 0);
 }
+#endif
+
+char *
+tmt_inbuf(TMT *vt, size_t *n)
+{
+    if (!vt->inbuf && !(vt->inbuf = ALLOC(vt, INBUF)))
+        return NULL;
+    *n = INBUF;
+    return vt->inbuf;
+}
+
+void
+tmt_commit(TMT *vt, size_t n)
+{
+    TMTPOINT oc = vt->curs;
+    if (!thaw(vt)) return;
+    parse(vt, vt->inbuf, MIN(n, vt->inbuf? INBUF : 0));
+    notify(vt, vt->dirty, memcmp(&oc, &vt->curs, sizeof(oc)) != 0);
+}
+
+void
+tmt_begin_batch(TMT *vt)
+{
+    if (!vt->batch++)
+        vt->bcurs = vt->curs;
+}
+
+void
+tmt_end_batch(TMT *vt)
+{
+    if (vt->batch && !--vt->batch)
+        notify(vt, vt->dirty, memcmp(&vt->bcurs, &vt->curs, sizeof(TMTPOINT)) != 0);
+}
 
 const TMTSCREEN *
-tmt_screen(const TMT *vt)
+tmt_screen(TMT *vt)
 {
+    /* Erased cells are filled in only when something outside the
+     * library is about to read them.
+     */
+    fillblanks(vt);
     return &vt->screen;
 }
 
@@ -485,21 +2004,642 @@ tmt_cursor(const TMT *vt)
     return &vt->curs;
 }
 
+bool
+tmt_color_rgb(const TMT *vt, tmt_color_t c, unsigned char rgb[3])
+{
+    /* The standard xterm palette. */
+    static const unsigned char base[16][3] = {
+        {  0,   0,   0}, {205,   0,   0}, {  0, 205,   0}, {205, 205,   0},
+        {  0,   0, 238}, {205,   0, 205}, {  0, 205, 205}, {229, 229, 229},
+        {127, 127, 127}, {255,   0,   0}, {  0, 255,   0}, {255, 255,   0},
+        { 92,  92, 255}, {255,   0, 255}, {  0, 255, 255}, {255, 255, 255}
+    };
+    static const unsigned char level[6] = {0, 95, 135, 175, 215, 255};
+    int n = c;
+
+    if (n >= TMT_COLOR_BLACK && n < TMT_COLOR_MAX)
+        n -= TMT_COLOR_BLACK;
+    else if (n >= TMT_COLOR_PALETTE + 8 && n < TMT_COLOR_PALETTE + 256)
+        n -= TMT_COLOR_PALETTE;
+    else if (n >= TMT_COLOR_RGB && (size_t)(n - TMT_COLOR_RGB) < vt->nrgb){
+        uint32_t v = vt->rgb[n - TMT_COLOR_RGB];
+        rgb[0] = (unsigned char)(v >> 16);
+        rgb[1] = (unsigned char)(v >> 8);
+        rgb[2] = (unsigned char)v;
+        return true;
+    } else
+        return false;
+
+    if (n < 16)
+        memcpy(rgb, base[n], 3);
+    else if (n < 232){
+        rgb[0] = level[(n - 16) / 36];
+        rgb[1] = level[(n - 16) / 6 % 6];
+        rgb[2] = level[(n - 16) % 6];
+    } else
+        rgb[0] = rgb[1] = rgb[2] = (unsigned char)(8 + 10 * (n - 232));
+    return true;
+}
+
+bool
+tmt_damage_next(const TMT *vt, size_t *r, size_t *s, size_t *e)
+{
+    for (; *r < vt->screen.nline; (*r)++){
+        const LINEINFO *i = INFO(vt->screen.lines[*r]);
+        if (i->ds < i->de){
+            *s = i->ds;
+            *e = i->de;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool
+tmt_line_run(TMT *vt, size_t r, size_t *s, size_t *e)
+{
+    if (r >= vt->screen.nline || *s >= vt->screen.ncol) return false;
+
+    fillblanks(vt);
+    const TMTLINE *l = vt->screen.lines[r];
+    *e = vt->screen.ncol;
+    if (INFO(l)->mixed){
+        TMTATTRS a = l->chars[*s].a;
+        for (*e = *s + 1; *e < vt->screen.ncol; (*e)++)
+            if (!sameattrs(l->chars[*e].a, a)) break;
+    }
+    return true;
+}
+
+const char *
+tmt_line_text(TMT *vt, size_t r, size_t *n)
+{
+    const TEXT *t = r < vt->screen.nline? linetext(vt, r) : NULL;
+    if (!t) return NULL;
+    if (n) *n = t->len;
+    return t->s;
+}
+
+size_t
+tmt_screen_text(TMT *vt, char *buf, size_t n)
+{
+    size_t len = 0;
+    for (size_t r = 0; r < vt->screen.nline; r++){
+        const TEXT *t = linetext(vt, r);
+        if (!t) return 0;
+        len += t->len + 1;
+    }
+    if (len >= n) return len;
+
+    for (size_t r = 0; r < vt->screen.nline; r++){
+        const TEXT *t = linetext(vt, r);
+        memcpy(buf, t->s, t->len);
+        buf += t->len;
+        *buf++ = '\n';
+    }
+    *buf = 0;
+    return len;
+}
+
+void
+tmt_set_history(TMT *vt, size_t max)
+{
+    vt->hmax = max;
+    histevict(vt);
+    if (max) return;
+
+    for (size_t i = 0; i < vt->nseg; i++)
+        RELEASE(vt, vt->segs[i]);
+    RELEASE(vt, vt->segs);
+    RELEASE(vt, vt->hbuf);
+    vt->segs = NULL;
+    vt->hbuf = NULL;
+    vt->nseg = vt->szsegs = vt->szhbuf = vt->hbytes = vt->hline = 0;
+}
+
+size_t
+tmt_history_size(const TMT *vt)
+{
+    return vt->hline;
+}
+
+bool
+tmt_history_line(const TMT *vt, size_t n, TMTCHAR *out, size_t ncol)
+{
+    if (n >= vt->hline) return false;
+
+    size_t k = vt->hfirst + vt->hline - 1 - n, lo = 0, hi = vt->nseg;
+    while (hi - lo > 1){
+        size_t m = lo + (hi - lo) / 2;
+        if (vt->segs[m]->first <= k) lo = m; else hi = m;
+    }
+
+    const HISTSEG *g = vt->segs[lo];
+    uint32_t len, run, c;
+    const unsigned char *p = getnum(g->data + SLOT(g, k - g->first), &len);
+    size_t i = 0;
+    while (i < len && i < ncol){
+        p = getnum(p, &run);
+        TMTATTRS a = unpackattrs(p[0] | p[1] << 8 | (uint32_t)p[2] << 16
+                                 | (uint32_t)p[3] << 24);
+        for (p += 4; run && i < ncol; run--, i++){
+            p = getnum(p, &c);
+            out[i].c = (wchar_t)c;
+            out[i].a = a;
+        }
+    }
+    for (; i < ncol; i++){
+        out[i].c = L' ';
+        out[i].a = defattrs;
+    }
+    return true;
+}
+
+static void
+put32(unsigned char *b, size_t v)
+{
+    uint32_t n = (uint32_t)MIN(v, UINT32_MAX);
+    for (int i = 0; i < 4; i++)
+        b[i] = (unsigned char)(n >> (8 * i));
+}
+
+static uint32_t
+get32(const unsigned char *b)
+{
+    return b[0] | b[1] << 8 | (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24;
+}
+
+static bool
+flatcells(void)
+{
+    /* Whether cells in memory are already in the snapshot format, so
+     * that whole lines can be copied in and out at once.
+     */
+    TMTCHAR t;
+    unsigned char b[8];
+    memset(&t, 0, sizeof(t));
+    t.c = (wchar_t)0x1f600;
+    t.a.bold = t.a.underline = t.a.reverse = true;
+    t.a.fg = -3;
+    t.a.bg = 0x5a3;
+    put32(b, (uint32_t)t.c);
+    put32(b + 4, packattrs(t.a));
+    return sizeof(TMTCHAR) == 8 && !memcmp(&t, b, 8);
+}
+
+static size_t
+snapsize(size_t nline, size_t ncol, size_t nrgb, size_t nmb)
+{
+    size_t n = SNAP_HEAD + nrgb * 4 + (ncol + 7) / 8 + nmb;
+    return (n + 7) / 8 * 8 + nline * ncol * 8;
+}
+
+size_t
+tmt_snapshot(TMT *vt, void *buf, size_t n)
+{
+    /* The format is a header of 32-bit little-endian fields, then the
+     * truecolor table, tab stops, and any partial multibyte character,
+     * and then, eight-byte aligned, the cells of each line in order as
+     * a 32-bit character and 32-bit packed attributes.
+     */
+    fillblanks(vt);
+    const TMTSCREEN *s = &vt->screen;
+    #ifdef TMT_UTF8
+    size_t nmb = 0, u8s = vt->u8s, utf8 = 1;
+    size_t u8c = u8s == U8_ACCEPT? 0 : (uint32_t)vt->u8c;
+    const char *mb = "";
+    #else
+    size_t nmb = vt->nmb, u8s = 0, u8c = 0, utf8 = 0;
+    const char *mb = vt->mb;
+    #endif
+    size_t sz = snapsize(s->nline, s->ncol, vt->nrgb, nmb);
+    if (n < sz) return sz;
+
+    unsigned char *b = buf, *p = b + SNAP_HEAD;
+    size_t h[SNAP_HEAD / 4] = {SNAP_MAGIC, SNAP_VERSION, sz - s->nline * s->ncol * 8,
+        s->nline, s->ncol, vt->curs.r, vt->curs.c, vt->oldcurs.r, vt->oldcurs.c,
+        packattrs(vt->attrs), packattrs(vt->oldattrs),
+        vt->acs | vt->ignored << 1 | utf8 << 2, vt->state, vt->npar, vt->arg,
+        vt->nrgb, nmb, u8s, u8c, vt->top, vt->bot};
+    for (size_t i = 0; i < PAR_MAX; i++)
+        h[21 + i] = vt->pars[i];
+    for (size_t i = 0; i < SNAP_HEAD / 4; i++)
+        put32(b + 4 * i, h[i]);
+
+    for (size_t i = 0; i < vt->nrgb; i++, p += 4)
+        put32(p, vt->rgb[i]);
+    memset(p, 0, (s->ncol + 7) / 8);
+    for (size_t i = 0; i < s->ncol; i++)
+        p[i / 8] |= (vt->tabs->chars[i].c == L'*') << (i % 8);
+    p += (s->ncol + 7) / 8;
+    memcpy(p, mb, nmb);
+    p += nmb;
+    memset(p, 0, (size_t)(b + h[2] - p));
+
+    p = b + h[2];
+    bool flat = flatcells();
+    for (size_t r = 0; r < s->nline; r++, p += s->ncol * 8){
+        const TMTCHAR *l = s->lines[r]->chars;
+        if (flat)
+            memcpy(p, l, s->ncol * 8);
+        else for (size_t i = 0; i < s->ncol; i++){
+            put32(p + i * 8, (uint32_t)l[i].c);
+            put32(p + i * 8 + 4, packattrs(l[i].a));
+        }
+    }
+    return sz;
+}
+
+bool
+tmt_restore(TMT *vt, const void *buf, size_t n)
+{
+    const unsigned char *b = buf, *p = b + SNAP_HEAD;
+    uint32_t h[SNAP_HEAD / 4];
+    if (n < SNAP_HEAD) return false;
+    for (size_t i = 0; i < SNAP_HEAD / 4; i++)
+        h[i] = get32(b + 4 * i);
+
+    size_t nline = h[3], ncol = h[4], nrgb = h[15], nmb = h[16];
+    if (h[0] != SNAP_MAGIC || h[1] != SNAP_VERSION || nline < 2 || ncol < 2
+        || h[12] > S_ARG || h[13] > PAR_MAX || nrgb > RGB_MAX || nmb > BUF_MAX
+        || nline > SIZE_MAX / 8 / ncol || n < snapsize(nline, ncol, nrgb, nmb)
+        || h[2] != snapsize(nline, ncol, nrgb, nmb) - nline * ncol * 8)
+        return false;
+
+    uint32_t *rgb = RESIZE(vt, vt->rgb, MAX(nrgb, 1) * sizeof(uint32_t));
+    if (!rgb) return false;
+    vt->rgb = rgb;
+    vt->szrgb = MAX(nrgb, 1);
+
+    tmt_begin_batch(vt);
+    if (!tmt_resize(vt, nline, ncol)) return tmt_end_batch(vt), false;
+
+    vt->nrgb = nrgb;
+    for (size_t i = 0; i < nrgb; i++, p += 4)
+        vt->rgb[i] = get32(p);
+    for (size_t i = 0; i < ncol; i++)
+        vt->tabs->chars[i].c = p[i / 8] >> (i % 8) & 1? L'*' : L' ';
+    p += (ncol + 7) / 8;
+
+    #ifdef TMT_UTF8
+    vt->u8s = h[11] & 4 && h[17] < U8_REJECT? (unsigned char)h[17] : U8_ACCEPT;
+    vt->u8c = vt->u8s == U8_ACCEPT? 0 : (wchar_t)h[18];
+    #else
+    memset(&vt->ms, 0, sizeof(vt->ms));
+    memcpy(vt->mb, p, vt->nmb = h[11] & 4? 0 : nmb);
+    #endif
+
+    vt->curs.r = h[5];
+    vt->curs.c = h[6];
+    vt->oldcurs.r = MIN(h[7], nline - 1);
+    vt->oldcurs.c = MIN(h[8], ncol - 1);
+    vt->attrs = unpackattrs(h[9]);
+    vt->oldattrs = unpackattrs(h[10]);
+    vt->acs = h[11] & 1;
+    vt->ignored = h[11] >> 1 & 1;
+    vt->state = h[12];
+    vt->npar = h[13];
+    vt->arg = h[14];
+    for (size_t i = 0; i < PAR_MAX; i++)
+        vt->pars[i] = h[21 + i];
+    if (h[19] + 1 < h[20] && h[20] <= nline){
+        vt->top = h[19];
+        vt->bot = h[20];
+    }
+
+    p = b + h[2];
+    bool flat = flatcells();
+    fillblanks(vt);
+    for (size_t r = 0; r < nline; r++, p += ncol * 8){
+        TMTCHAR *l = vt->screen.lines[r]->chars;
+        if (flat){
+            memcpy(l, p, ncol * 8);
+            for (size_t i = 0; i < ncol; i++) /* bits the format doesn't use */
+                if (p[i * 8 + 7] & 0xc0)
+                    l[i].a = unpackattrs(get32(p + i * 8 + 4));
+        } else for (size_t i = 0; i < ncol; i++){
+            l[i].c = (wchar_t)get32(p + i * 8);
+            l[i].a = unpackattrs(get32(p + i * 8 + 4));
+        }
+        INFO(vt->screen.lines[r])->mixed = true;
+        INFO(vt->screen.lines[r])->wrap = 0;
+        forget(vt, vt->screen.lines[r]);
+    }
+
+    fixcursor(vt);
+    dirtylines(vt, 0, nline);
+    tmt_end_batch(vt);
+    return true;
+}
+
+#ifdef TMT_PUBLISH
+static FRAME *
+newframe(TMT *vt, size_t nline, size_t ncol)
+{
+    size_t w = aligned(sizeof(TMTLINE) + ncol * sizeof(TMTCHAR));
+    size_t o = aligned(sizeof(FRAME) + nline * (sizeof(TMTLINE *)
+                       + sizeof(uint64_t) + sizeof(size_t)));
+    FRAME *f = ALLOC(vt, o + nline * w);
+    if (!f) return NULL;
+
+    memset(f, 0, o + nline * w);
+    f->f.screen.nline = nline;
+    f->f.screen.ncol = ncol;
+    f->f.screen.lines = (TMTLINE **)(f + 1);
+    f->gen = (uint64_t *)(f->f.screen.lines + nline);
+    f->since = (size_t *)(f->gen + nline);
+    f->f.since = f->since;
+    for (size_t i = 0; i < nline; i++)
+        f->f.screen.lines[i] = (TMTLINE *)((char *)f + o + i * w);
+    return f;
+}
+
+static bool
+samesize(const FRAME *f, const TMTSCREEN *s)
+{
+    return f && f->f.screen.nline == s->nline && f->f.screen.ncol == s->ncol;
+}
+
+bool
+tmt_publish(TMT *vt)
+{
+    /* Only the writer touches the back buffer, and the frame it last
+     * published is never written again until the reader hands it back,
+     * so both can be read here without synchronization.
+     */
+    fillblanks(vt);
+    const TMTSCREEN *s = &vt->screen;
+    FRAME *f = vt->frames[vt->back], *o = vt->frames[vt->last];
+    if (!samesize(f, s)){
+        RELEASE(vt, f);
+        f = vt->frames[vt->back] = newframe(vt, s->nline, s->ncol);
+        if (!f) return false;
+    }
+    if (!samesize(o, s))
+        o = NULL;
+
+    f->f.seq = ++vt->seq;
+    f->f.curs = vt->curs;
+    for (size_t i = 0; i < s->nline; i++){
+        uint64_t g = vt->store? vt->gens[i] : INFO(s->lines[i])->gen;
+        f->since[i] = o && o->gen[i] == g? o->since[i] : f->f.seq;
+        if (f->gen[i] != g)
+            memcpy(f->f.screen.lines[i]->chars, s->lines[i]->chars,
+                   s->ncol * sizeof(TMTCHAR));
+        f->gen[i] = g;
+    }
+
+    vt->last = vt->back;
+    vt->back = atomic_exchange_explicit(&vt->mid, vt->back | FRESH,
+                                        memory_order_acq_rel) & ~FRESH;
+    return true;
+}
+
+const TMTFRAME *
+tmt_acquire(TMT *vt)
+{
+    if (atomic_load_explicit(&vt->mid, memory_order_relaxed) & FRESH)
+        vt->front = atomic_exchange_explicit(&vt->mid, vt->front,
+                                             memory_order_acq_rel) & ~FRESH;
+    return vt->frames[vt->front]? &vt->frames[vt->front]->f : NULL;
+}
+#endif
+
+#ifdef TMT_STATS
+void
+tmt_stats(const TMT *vt, TMTSTATS *s)
+{
+    *s = vt->stats;
+}
+#endif
+
 void
 tmt_clean(TMT *vt)
 {
-    for (size_t i = 0; i < vt->screen.nline; i++)
+    if (vt->store) return; /* nothing to clean, and the lines are shared */
+    for (size_t i = 0; i < vt->screen.nline; i++){
         vt->dirty = vt->screen.lines[i]->dirty = false;
+        INFO(vt->screen.lines[i])->ds = INFO(vt->screen.lines[i])->de = 0;
+    }
 }
 
 void
 tmt_reset(TMT *vt)
 {
+    if (!thaw(vt)) return;
     vt->curs.r = vt->curs.c = vt->oldcurs.r = vt->oldcurs.c = vt->acs = (bool)0;
     resetparser(vt);
     vt->attrs = vt->oldattrs = defattrs;
+    vt->top = 0;
+    vt->bot = vt->screen.nline;
+    #ifdef TMT_UTF8
+    vt->u8s = U8_ACCEPT;
+    #else
     memset(&vt->ms, 0, sizeof(vt->ms));
+    #endif
     clearlines(vt, 0, vt->screen.nline);
     CB(vt, TMT_MSG_CURSOR, "t");
     notify(vt, true, true);
 }
+
+TMTSTORE *
+tmt_store_open(const TMTALLOC *mem)
+{
+    mem = mem? mem : &stdmem;
+    TMTSTORE *s = mem->alloc(mem->p, sizeof(TMTSTORE));
+    if (!s) return NULL;
+    memset(s, 0, sizeof(TMTSTORE));
+    s->mem = *mem;
+    return s;
+}
+
+void
+tmt_store_close(TMTSTORE *s)
+{
+    if (!s) return;
+    for (size_t i = 0; i < s->nbucket; i++){
+        for (SHARED *h = s->buckets[i], *next; h; h = next){
+            next = h->next;
+            s->mem.release(s->mem.p, h);
+        }
+    }
+    if (s->buckets)
+        s->mem.release(s->mem.p, s->buckets);
+    s->mem.release(s->mem.p, s);
+}
+
+bool
+tmt_compact(TMT *vt, TMTSTORE *s)
+{
+    /* Only a clean screen can be shared: the damage kept with each line
+     * belongs to one terminal.
+     */
+    size_t nline = vt->screen.nline, ncol = vt->screen.ncol, i = 0;
+    if (vt->store) return vt->store == s;
+    if (vt->batch || vt->dirty) return false;
+    for (i = 0; i < nline; i++)
+        if (vt->screen.lines[i]->dirty) return false;
+
+    fillblanks(vt);
+    uint64_t *g = ALLOC(vt, nline * (sizeof(uint64_t) + sizeof(TMTLINE *)));
+    if (!g) return false;
+    TMTLINE **l = (TMTLINE **)(g + nline), *t = intern(s, vt->tabs, ncol);
+    for (i = 0; t && i < nline; i++){
+        g[i] = INFO(vt->screen.lines[i])->gen;
+        if (!(l[i] = intern(s, vt->screen.lines[i], ncol))) break;
+    }
+    if (i < nline){
+        while (i) unshare(s, l[--i]);
+        if (t) unshare(s, t);
+        RELEASE(vt, g);
+        return false;
+    }
+
+    /* Texts are kept by row from now on.  Only the matches reported on
+     * each line are worth keeping.
+     */
+    TEXT k[vt->texts? nline : 1];
+    for (i = 0; vt->texts && i < nline; i++){
+        k[i] = vt->texts[slot(vt, i)];
+        RELEASE(vt, k[i].s);
+        k[i].s = NULL;
+        k[i].len = k[i].size = 0;
+    }
+    if (vt->texts)
+        memcpy(vt->texts, k, nline * sizeof(TEXT));
+
+    RELEASE(vt, vt->slab);
+    RELEASE(vt, vt->inbuf);
+    RELEASE(vt, vt->hbuf);
+    RELEASE(vt, vt->text);
+    RELEASE(vt, vt->rows);
+    vt->inbuf = vt->text = NULL;
+    vt->hbuf = NULL;
+    vt->rows = NULL;
+    vt->szhbuf = vt->sztext = vt->szrows = 0;
+    vt->slab = vt->gens = g;
+    vt->ring = vt->screen.lines = l;
+    vt->lazy = NULL;
+    vt->tabs = t;
+    vt->base = 0;
+    vt->store = s;
+    return true;
+}
+
+static EXPECT *
+newexpect(TMT *vt)
+{
+    if (vt->npat == vt->szpat){
+        size_t n = vt->szpat? vt->szpat * 2 : 4;
+        EXPECT *p = RESIZE(vt, vt->pats, n * sizeof(EXPECT));
+        if (!p) return NULL;
+        vt->pats = p;
+        vt->szpat = n;
+    }
+    return memset(vt->pats + vt->npat, 0, sizeof(EXPECT));
+}
+
+static bool
+addexpect(TMT *vt, int id)
+{
+    /* The whole screen is searched again for the new pattern; what was
+     * reported before for the others isn't reported again.
+     */
+    vt->sgen = 0;
+    vt->pats[vt->npat++].id = id;
+    return true;
+}
+
+static void
+unexpect(TMT *vt, EXPECT *x)
+{
+    RELEASE(vt, x->s);
+    #ifdef TMT_HAS_REGEX
+    if (x->re) regfree(x->re);
+    RELEASE(vt, x->re);
+    #endif
+}
+
+bool
+tmt_expect_add(TMT *vt, const char *pattern, int id)
+{
+    size_t n = strlen(pattern);
+    EXPECT *x = n? newexpect(vt) : NULL;
+    if (!x || !(x->s = ALLOC(vt, n + 1))) return false;
+    memcpy(x->s, pattern, n + 1);
+    return addexpect(vt, id);
+}
+
+#ifdef TMT_HAS_REGEX
+bool
+tmt_expect_add_regex(TMT *vt, const char *pattern, int id)
+{
+    EXPECT *x = newexpect(vt);
+    if (!x || !(x->re = ALLOC(vt, sizeof(regex_t)))) return false;
+    if (regcomp(x->re, pattern, REG_EXTENDED))
+        return RELEASE(vt, x->re), false;
+    return addexpect(vt, id);
+}
+#endif
+
+void
+tmt_expect_remove(TMT *vt, int id)
+{
+    size_t j = 0;
+    for (size_t i = 0; i < vt->npat; i++){
+        if (vt->pats[i].id == id)
+            unexpect(vt, &vt->pats[i]);
+        else
+            vt->pats[j++] = vt->pats[i];
+    }
+    vt->npat = j;
+
+    /* If the id is used again, its matches are news again. */
+    for (size_t i = 0; vt->texts && i < vt->capline; i++){
+        TEXT *t = vt->texts + i;
+        size_t k = 0;
+        for (size_t n = 0; n < t->nseen; n++)
+            if (t->seen[n].id != id) t->seen[k++] = t->seen[n];
+        t->nseen = k;
+    }
+}
+
+#ifdef TMT_HAS_POLL
+bool
+tmt_expect_wait(TMT *vt, int fd, int timeout, TMTMATCH *m)
+{
+    /* Feed vt from fd until a pattern matches or the time runs out. */
+    struct timespec t0, t;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    vt->want = m;
+    if (vt->npat)
+        expect(vt);
+    while (vt->want){
+        int left = -1;
+        if (timeout >= 0){
+            clock_gettime(CLOCK_MONOTONIC, &t);
+            long ms = (long)(t.tv_sec - t0.tv_sec) * 1000
+                    + (t.tv_nsec - t0.tv_nsec) / 1000000;
+            if (ms >= timeout) break;
+            left = timeout - (int)ms;
+        }
+
+        struct pollfd p = {fd, POLLIN, 0};
+        int r = poll(&p, 1, left);
+        if (r < 0 && errno != EINTR) break;
+        if (r <= 0) continue;
+
+        size_t n;
+        char *b = tmt_inbuf(vt, &n);
+        ssize_t k = b? read(fd, b, n) : 0;
+        if (k > 0)
+            tmt_commit(vt, (size_t)k);
+        else if (!k || (errno != EINTR && errno != EAGAIN))
+            break;
+    }
+
+    bool found = !vt->want;
+    vt->want = NULL;
+    return found;
+}
+#endif
@@ -32,6 +32,10 @@
 #include <stddef.h>
 #include <wchar.h>
 
+#ifdef TMT_HAS_IOVEC
+#include <sys/uio.h>
+#endif
+
 /**** INVALID WIDE CHARACTER */
 #ifndef TMT_INVALID_CHAR
 #define TMT_INVALID_CHAR ((wchar_t)0xfffd)
@@ -74,19 +78,21 @@ typedef enum{
     TMT_COLOR_MAGENTA,
     TMT_COLOR_CYAN,
     TMT_COLOR_WHITE,
-    TMT_COLOR_MAX
+    TMT_COLOR_MAX,
+    TMT_COLOR_PALETTE = 0x100,
+    TMT_COLOR_RGB = 0x200
 } tmt_color_t;
 
 typedef struct TMTATTRS TMTATTRS;
 struct TMTATTRS{
-    bool bold;
-    bool dim;
-    bool underline;
-    bool blink;
-    bool reverse;
-    bool invisible;
-    tmt_color_t fg;
-    tmt_color_t bg;
+    bool bold:1;
+    bool dim:1;
+    bool underline:1;
+    bool blink:1;
+    bool reverse:1;
+    bool invisible:1;
+    signed int fg:12; /* a tmt_color_t */
+    signed int bg:12; /* a tmt_color_t */
 };
 
 typedef struct TMTCHAR TMTCHAR;
@@ -121,20 +127,109 @@ typedef enum{
     TMT_MSG_UPDATE,
     TMT_MSG_ANSWER,
     TMT_MSG_BELL,
-    TMT_MSG_CURSOR
+    TMT_MSG_CURSOR,
+    TMT_MSG_SCROLL,
+    TMT_MSG_MATCH
 } tmt_msg_t;
 
+typedef struct TMTSCROLL TMTSCROLL;
+struct TMTSCROLL{
+    size_t s;
+    size_t e;
+    size_t n;
+    bool up;
+};
+
+typedef struct TMTMATCH TMTMATCH;
+struct TMTMATCH{
+    int id;
+    size_t r;
+    size_t s;
+    size_t e;
+};
+
 typedef void (*TMTCALLBACK)(tmt_msg_t m, struct TMT *v, const void *r, void *p);
 
+/**** ALLOCATOR SUPPORT */
+typedef struct TMTALLOC TMTALLOC;
+struct TMTALLOC{
+    void *(*alloc)(void *p, size_t n);
+    void *(*resize)(void *p, void *o, size_t n);
+    void (*release)(void *p, void *o);
+    void *p;
+};
+
+/**** SHARED LINES */
+typedef struct TMTSTORE TMTSTORE;
+
+/**** PUBLISHING SUPPORT */
+typedef struct TMTFRAME TMTFRAME;
+struct TMTFRAME{
+    size_t seq;
+    TMTSCREEN screen;
+    TMTPOINT curs;
+    const size_t *since;
+};
+
+/**** INSTRUMENTATION */
+typedef struct TMTSTATS TMTSTATS;
+struct TMTSTATS{
+    size_t bytes;
+    size_t chars;
+    size_t csi[0x7f - '@'];
+    size_t unknown;
+    size_t scrolled;
+    size_t cleared;
+    size_t callbacks;
+    size_t resizes;
+};
+
 /**** PUBLIC FUNCTIONS */
 TMT *tmt_open(size_t nline, size_t ncol, TMTCALLBACK cb, void *p,
               const wchar_t *acs);
+TMT *tmt_open_alloc(size_t nline, size_t ncol, TMTCALLBACK cb, void *p,
+                    const wchar_t *acs, const TMTALLOC *mem);
 void tmt_close(TMT *vt);
 bool tmt_resize(TMT *vt, size_t nline, size_t ncol);
 void tmt_write(TMT *vt, const char *s, size_t n);
-const TMTSCREEN *tmt_screen(const TMT *vt);
+#ifdef TMT_HAS_IOVEC
+void tmt_writev(TMT *vt, const struct iovec *iov, int n);
+#endif
+char *tmt_inbuf(TMT *vt, size_t *n);
+void tmt_commit(TMT *vt, size_t n);
+void tmt_begin_batch(TMT *vt);
+void tmt_end_batch(TMT *vt);
+const TMTSCREEN *tmt_screen(TMT *vt);
 const TMTPOINT *tmt_cursor(const TMT *vt);
+bool tmt_damage_next(const TMT *vt, size_t *r, size_t *s, size_t *e);
+bool tmt_line_run(TMT *vt, size_t r, size_t *s, size_t *e);
+const char *tmt_line_text(TMT *vt, size_t r, size_t *n);
+size_t tmt_screen_text(TMT *vt, char *buf, size_t n);
+bool tmt_color_rgb(const TMT *vt, tmt_color_t c, unsigned char rgb[3]);
+void tmt_set_history(TMT *vt, size_t max);
+size_t tmt_history_size(const TMT *vt);
+bool tmt_history_line(const TMT *vt, size_t n, TMTCHAR *out, size_t ncol);
+size_t tmt_snapshot(TMT *vt, void *buf, size_t n);
+bool tmt_restore(TMT *vt, const void *buf, size_t n);
+#ifdef TMT_PUBLISH
+bool tmt_publish(TMT *vt);
+const TMTFRAME *tmt_acquire(TMT *vt);
+#endif
+#ifdef TMT_STATS
+void tmt_stats(const TMT *vt, TMTSTATS *s);
+#endif
 void tmt_clean(TMT *vt);
 void tmt_reset(TMT *vt);
+TMTSTORE *tmt_store_open(const TMTALLOC *mem);
+void tmt_store_close(TMTSTORE *s);
+bool tmt_compact(TMT *vt, TMTSTORE *s);
+bool tmt_expect_add(TMT *vt, const char *pattern, int id);
+#ifdef TMT_HAS_REGEX
+bool tmt_expect_add_regex(TMT *vt, const char *pattern, int id);
+#endif
+void tmt_expect_remove(TMT *vt, int id);
+#ifdef TMT_HAS_POLL
+bool tmt_expect_wait(TMT *vt, int fd, int timeout, TMTMATCH *m);
+#endif
 
 #endif
@@ -0,0 +1,591 @@
+/* Copyright (c) 2017 Rob King
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the copyright holder nor the
+ *     names of contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS,
+ * COPYRIGHT HOLDERS, OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "tmtpool.h"
+
+#define READ_MAX 65536
+#define EVENTS 64
+#define KICK UINT64_MAX
+#define ID(i, n) ((uint64_t)(n) << 32 | (uint64_t)(i))
+#define SLOT(id) ((size_t)(uint32_t)(id))
+
+/* Each worker has its own epoll set, holding the sessions that live on
+ * it, and its own queue of sessions that are ready to be read.  Sessions
+ * that still have input after a full read go back on the queue, where an
+ * idle worker can steal them.  Queues and epoll sets refer to sessions
+ * by slot and serial number, so a session can be removed at any time.
+ */
+typedef struct WORKER WORKER;
+struct WORKER{
+    TMTPOOL *pool;
+    pthread_t t;
+    int ep, kick;
+    size_t nsession;
+
+    pthread_mutex_t mu; /* protects everything below */
+    uint64_t *q;
+    size_t head, n, size;
+    bool idle, stop, started;
+
+    char buf[READ_MAX];
+};
+
+struct TMTSESSION{
+    TMTPOOL *pool;
+    WORKER *home;
+    uint64_t id;
+    int fd;
+    void *data;
+
+    pthread_mutex_t mu; /* protects everything below */
+    TMT *vt;
+    TMTEVENT *q;
+    size_t head, n, size;
+    bool update, moved, bell, hup;
+
+    TMTSESSION *next; /* these are protected by the pool's mu */
+    bool ready;
+};
+
+struct TMTPOOL{
+    WORKER *w;
+    size_t nworker;
+
+    pthread_rwlock_t lk; /* protects the session table */
+    TMTSESSION **slots;
+    size_t *spare;
+    size_t nslot, nspare, szslot;
+    uint32_t serial;
+
+    pthread_mutex_t mu; /* protects the ready list */
+    pthread_cond_t cv;
+    TMTSESSION *first, *last;
+};
+
+static bool
+queue(TMTSESSION *s, const TMTEVENT *e)
+{
+    if (s->head + s->n == s->size && s->head){
+        memmove(s->q, s->q + s->head, s->n * sizeof(TMTEVENT));
+        s->head = 0;
+    } else if (s->n == s->size){
+        size_t n = s->size? s->size * 2 : 16;
+        TMTEVENT *q = realloc(s->q, n * sizeof(TMTEVENT));
+        if (!q) return false;
+        s->q = q;
+        s->size = n;
+    }
+    s->q[s->head + s->n++] = *e;
+    return true;
+}
+
+static void
+callback(tmt_msg_t m, TMT *vt, const void *a, void *p)
+{
+    /* Called from tmt_write, with the session locked.  Scrolls, answers,
+     * cursor changes, and matches are queued in order, with each run of
+     * similar scrolls merged; the rest are just noted, and reported after
+     * them.
+     */
+    TMTSESSION *s = p;
+    TMTEVENT e = {.m = m};
+    (void)vt;
+
+    switch (m){
+        case TMT_MSG_UPDATE: s->update = true; return;
+        case TMT_MSG_MOVED:  s->moved = true;  return;
+        case TMT_MSG_BELL:   s->bell = true;   return;
+
+        case TMT_MSG_SCROLL:
+            e.scroll = *(const TMTSCROLL *)a;
+            if (s->n){
+                TMTEVENT *l = s->q + s->head + s->n - 1;
+                if (l->m == TMT_MSG_SCROLL && l->scroll.s == e.scroll.s
+                 && l->scroll.e == e.scroll.e && l->scroll.up == e.scroll.up){
+                    l->scroll.n += e.scroll.n;
+                    return;
+                }
+            }
+            break;
+
+        case TMT_MSG_MATCH:
+            e.match = *(const TMTMATCH *)a;
+            break;
+
+        case TMT_MSG_ANSWER:
+        case TMT_MSG_CURSOR:
+            snprintf(e.s, sizeof(e.s), "%s", (const char *)a);
+            break;
+    }
+    queue(s, &e);
+}
+
+static void
+post(TMTSESSION *s)
+{
+    TMTPOOL *p = s->pool;
+    pthread_mutex_lock(&p->mu);
+    if (!s->ready){
+        s->ready = true;
+        s->next = NULL;
+        if (p->last)
+            p->last->next = s;
+        else
+            p->first = s;
+        p->last = s;
+        pthread_cond_signal(&p->cv);
+    }
+    pthread_mutex_unlock(&p->mu);
+}
+
+static bool
+push(WORKER *w, uint64_t id)
+{
+    pthread_mutex_lock(&w->mu);
+    if (w->n == w->size){
+        size_t n = w->size? w->size * 2 : 16;
+        uint64_t *q = malloc(n * sizeof(uint64_t));
+        if (!q) return pthread_mutex_unlock(&w->mu), false;
+        for (size_t i = 0; i < w->n; i++)
+            q[i] = w->q[(w->head + i) % w->size];
+        free(w->q);
+        w->q = q;
+        w->head = 0;
+        w->size = n;
+    }
+    w->q[(w->head + w->n++) % w->size] = id;
+    pthread_mutex_unlock(&w->mu);
+    return true;
+}
+
+static bool
+pop(WORKER *w, uint64_t *id, bool back)
+{
+    bool r = false;
+    pthread_mutex_lock(&w->mu);
+    if (w->n){
+        r = true;
+        w->n--;
+        if (back)
+            *id = w->q[(w->head + w->n) % w->size];
+        else{
+            *id = w->q[w->head];
+            w->head = (w->head + 1) % w->size;
+        }
+    }
+    w->idle = false;
+    pthread_mutex_unlock(&w->mu);
+    return r;
+}
+
+static bool
+steal(WORKER *w, uint64_t *id)
+{
+    TMTPOOL *p = w->pool;
+    for (size_t i = 1; i < p->nworker; i++){
+        WORKER *v = p->w + (w - p->w + i) % p->nworker;
+        if (pop(v, id, true))
+            return true;
+    }
+    return false;
+}
+
+static void
+kick(WORKER *w)
+{
+    /* Wake an idle worker to steal the work that is piling up here. */
+    TMTPOOL *p = w->pool;
+    for (size_t i = 1; i < p->nworker; i++){
+        WORKER *v = p->w + (w - p->w + i) % p->nworker;
+        pthread_mutex_lock(&v->mu);
+        bool idle = v->idle;
+        v->idle = false;
+        pthread_mutex_unlock(&v->mu);
+        if (idle){
+            uint64_t k = 1;
+            if (write(v->kick, &k, sizeof(k)) < 0) continue;
+            return;
+        }
+    }
+}
+
+static TMTSESSION *
+grab(TMTPOOL *p, uint64_t id)
+{
+    TMTSESSION *s = NULL;
+    pthread_rwlock_rdlock(&p->lk);
+    if (SLOT(id) < p->nslot && p->slots[SLOT(id)]
+     && p->slots[SLOT(id)]->id == id){
+        s = p->slots[SLOT(id)];
+        pthread_mutex_lock(&s->mu);
+    }
+    pthread_rwlock_unlock(&p->lk);
+    return s;
+}
+
+static bool
+arm(TMTSESSION *s, int op)
+{
+    struct epoll_event e = {.events = EPOLLIN | EPOLLONESHOT, .data.u64 = s->id};
+    return epoll_ctl(s->home->ep, op, s->fd, &e) == 0;
+}
+
+static void
+run(WORKER *w, uint64_t id)
+{
+    /* Read as much as is available, up to a full buffer, and hand it to
+     * the terminal in one go.
+     */
+    TMTSESSION *s = grab(w->pool, id);
+    if (!s) return;
+
+    size_t n = 0;
+    ssize_t r;
+    int err = 0;
+    for (;;){
+        r = read(s->fd, w->buf + n, READ_MAX - n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) err = errno;
+        if (r <= 0 || (n += (size_t)r) == READ_MAX) break;
+    }
+
+    if (n)
+        tmt_write(s->vt, w->buf, n);
+    if (r == 0 || (r < 0 && err != EAGAIN && err != EWOULDBLOCK))
+        s->hup = true;
+    else if (n == READ_MAX && push(w, id))
+        kick(w);
+    else if (!arm(s, EPOLL_CTL_MOD))
+        s->hup = true;
+
+    if (s->hup || s->n || s->update || s->moved || s->bell)
+        post(s);
+    pthread_mutex_unlock(&s->mu);
+}
+
+static bool
+kicked(WORKER *w)
+{
+    uint64_t k;
+    while (read(w->kick, &k, sizeof(k)) < 0 && errno == EINTR)
+        ;
+    pthread_mutex_lock(&w->mu);
+    bool stop = w->stop;
+    pthread_mutex_unlock(&w->mu);
+    return stop;
+}
+
+static void *
+work(void *a)
+{
+    WORKER *w = a;
+    struct epoll_event e[EVENTS];
+
+    for (;;){
+        uint64_t id;
+        bool busy = pop(w, &id, false) || steal(w, &id);
+        if (!busy){
+            pthread_mutex_lock(&w->mu);
+            w->idle = true;
+            pthread_mutex_unlock(&w->mu);
+        }
+
+        int n = epoll_wait(w->ep, e, EVENTS, busy? 0 : -1);
+        for (int i = 0; i < n; i++){
+            if (e[i].data.u64 == KICK){
+                if (kicked(w))
+                    return NULL;
+            } else if (!push(w, e[i].data.u64))
+                run(w, e[i].data.u64);
+        }
+        if (n > 1)
+            kick(w);
+        if (busy)
+            run(w, id);
+    }
+}
+
+static bool
+initworker(TMTPOOL *p, WORKER *w)
+{
+    struct epoll_event e = {.events = EPOLLIN, .data.u64 = KICK};
+
+    w->pool = p;
+    w->ep = epoll_create1(EPOLL_CLOEXEC);
+    w->kick = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_mutex_init(&w->mu, NULL);
+    if (w->ep >= 0 && w->kick >= 0
+     && epoll_ctl(w->ep, EPOLL_CTL_ADD, w->kick, &e) == 0)
+        return true;
+
+    if (w->ep >= 0) close(w->ep);
+    if (w->kick >= 0) close(w->kick);
+    pthread_mutex_destroy(&w->mu);
+    return false;
+}
+
+static void
+destroy(TMTSESSION *s)
+{
+    tmt_close(s->vt);
+    pthread_mutex_destroy(&s->mu);
+    free(s->q);
+    free(s);
+}
+
+TMTPOOL *
+tmt_pool_open(size_t nworker)
+{
+    if (!nworker){
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        nworker = n > 0? (size_t)n : 1;
+    }
+
+    TMTPOOL *p = calloc(1, sizeof(TMTPOOL));
+    if (!p) return NULL;
+    p->w = calloc(nworker, sizeof(WORKER));
+    if (!p->w) return free(p), NULL;
+
+    pthread_rwlock_init(&p->lk, NULL);
+    pthread_mutex_init(&p->mu, NULL);
+    pthread_cond_init(&p->cv, NULL);
+    for (; p->nworker < nworker; p->nworker++)
+        if (!initworker(p, p->w + p->nworker))
+            return tmt_pool_close(p), NULL;
+    for (size_t i = 0; i < nworker; i++){
+        p->w[i].started = pthread_create(&p->w[i].t, NULL, work, p->w + i) == 0;
+        if (!p->w[i].started)
+            return tmt_pool_close(p), NULL;
+    }
+    return p;
+}
+
+void
+tmt_pool_close(TMTPOOL *p)
+{
+    for (size_t i = 0; i < p->nworker; i++){
+        uint64_t k = 1;
+        pthread_mutex_lock(&p->w[i].mu);
+        p->w[i].stop = true;
+        pthread_mutex_unlock(&p->w[i].mu);
+        while (write(p->w[i].kick, &k, sizeof(k)) < 0 && errno == EINTR)
+            ;
+    }
+    for (size_t i = 0; i < p->nworker; i++){
+        if (p->w[i].started)
+            pthread_join(p->w[i].t, NULL);
+        close(p->w[i].ep);
+        close(p->w[i].kick);
+        pthread_mutex_destroy(&p->w[i].mu);
+        free(p->w[i].q);
+    }
+
+    for (size_t i = 0; i < p->nslot; i++) if (p->slots[i])
+        destroy(p->slots[i]);
+    pthread_rwlock_destroy(&p->lk);
+    pthread_mutex_destroy(&p->mu);
+    pthread_cond_destroy(&p->cv);
+    free(p->slots);
+    free(p->spare);
+    free(p->w);
+    free(p);
+}
+
+static bool
+place(TMTPOOL *p, TMTSESSION *s)
+{
+    size_t i;
+    if (p->nspare)
+        i = p->spare[--p->nspare];
+    else{
+        if (p->nslot == p->szslot){
+            size_t n = p->szslot? p->szslot * 2 : 64;
+            TMTSESSION **l = realloc(p->slots, n * sizeof(TMTSESSION *));
+            if (!l) return false;
+            p->slots = l;
+            size_t *f = realloc(p->spare, n * sizeof(size_t));
+            if (!f) return false;
+            p->spare = f;
+            p->szslot = n;
+        }
+        i = p->nslot++;
+    }
+
+    s->id = ID(i, ++p->serial);
+    s->home = p->w;
+    for (size_t j = 1; j < p->nworker; j++)
+        if (p->w[j].nsession < s->home->nsession)
+            s->home = p->w + j;
+    s->home->nsession++;
+    p->slots[i] = s;
+    return true;
+}
+
+TMTSESSION *
+tmt_pool_add(TMTPOOL *p, int fd, size_t nline, size_t ncol,
+             const wchar_t *acs, void *data)
+{
+    int f = fcntl(fd, F_GETFL);
+    if (f < 0) return NULL;
+
+    TMTSESSION *s = calloc(1, sizeof(TMTSESSION));
+    if (!s) return NULL;
+    s->pool = p;
+    s->fd = fd;
+    s->data = data;
+    pthread_mutex_init(&s->mu, NULL);
+    s->vt = tmt_open(nline, ncol, callback, s, acs);
+    if (!s->vt){
+        pthread_mutex_destroy(&s->mu);
+        return free(s), NULL;
+    }
+
+    pthread_rwlock_wrlock(&p->lk);
+    bool placed = place(p, s);
+    pthread_rwlock_unlock(&p->lk);
+    if (!placed) return destroy(s), NULL;
+
+    /* fd is made non-blocking only once nothing else can fail, and is
+     * given back as it was if that doesn't work out either.
+     */
+    if (fcntl(fd, F_SETFL, f | O_NONBLOCK) < 0 || !arm(s, EPOLL_CTL_ADD)){
+        tmt_pool_remove(s);
+        fcntl(fd, F_SETFL, f);
+        return NULL;
+    }
+    post(s);
+    return s;
+}
+
+void
+tmt_pool_remove(TMTSESSION *s)
+{
+    TMTPOOL *p = s->pool;
+
+    pthread_rwlock_wrlock(&p->lk);
+    p->slots[SLOT(s->id)] = NULL;
+    p->spare[p->nspare++] = SLOT(s->id);
+    s->home->nsession--;
+    pthread_rwlock_unlock(&p->lk);
+
+    /* No worker can find the session now, so once any that has it
+     * lets go, it is ours.
+     */
+    pthread_mutex_lock(&s->mu);
+    epoll_ctl(s->home->ep, EPOLL_CTL_DEL, s->fd, NULL);
+    pthread_mutex_unlock(&s->mu);
+
+    pthread_mutex_lock(&p->mu);
+    if (s->ready){
+        TMTSESSION **l = &p->first, *prev = NULL;
+        while (*l != s)
+            prev = *l, l = &(*l)->next;
+        *l = s->next;
+        if (p->last == s)
+            p->last = prev;
+    }
+    pthread_mutex_unlock(&p->mu);
+    destroy(s);
+}
+
+TMTSESSION *
+tmt_pool_wait(TMTPOOL *p, int timeout)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_REALTIME, &t);
+    t.tv_sec += timeout / 1000;
+    t.tv_nsec += timeout % 1000 * 1000000L;
+    if (t.tv_nsec >= 1000000000L)
+        t.tv_sec++, t.tv_nsec -= 1000000000L;
+
+    pthread_mutex_lock(&p->mu);
+    while (!p->first && (timeout < 0? !pthread_cond_wait(&p->cv, &p->mu)
+                                     : !pthread_cond_timedwait(&p->cv, &p->mu, &t)))
+        ;
+    TMTSESSION *s = p->first;
+    if (s){
+        p->first = s->next;
+        if (!p->first)
+            p->last = NULL;
+        s->ready = false;
+    }
+    pthread_mutex_unlock(&p->mu);
+    return s;
+}
+
+bool
+tmt_pool_next(TMTSESSION *s, TMTEVENT *e)
+{
+    if (s->n){
+        *e = s->q[s->head++];
+        s->head = --s->n? s->head : 0;
+    } else if (s->update)
+        e->m = TMT_MSG_UPDATE, s->update = false;
+    else if (s->moved)
+        e->m = TMT_MSG_MOVED, s->moved = false;
+    else if (s->bell)
+        e->m = TMT_MSG_BELL, s->bell = false;
+    else
+        return false;
+    return true;
+}
+
+bool
+tmt_pool_hungup(TMTSESSION *s)
+{
+    return s->hup;
+}
+
+TMT *
+tmt_pool_lock(TMTSESSION *s)
+{
+    pthread_mutex_lock(&s->mu);
+    return s->vt;
+}
+
+void
+tmt_pool_unlock(TMTSESSION *s)
+{
+    pthread_mutex_unlock(&s->mu);
+}
+
+void *
+tmt_pool_data(const TMTSESSION *s)
+{
+    return s->data;
+}
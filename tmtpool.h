@@ -0,0 +1,57 @@
+/* Copyright (c) 2017 Rob King
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the copyright holder nor the
+ *     names of contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS,
+ * COPYRIGHT HOLDERS, OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TMTPOOL_H
+#define TMTPOOL_H
+
+#include "tmt.h"
+
+typedef struct TMTPOOL TMTPOOL;
+typedef struct TMTSESSION TMTSESSION;
+
+typedef struct TMTEVENT TMTEVENT;
+struct TMTEVENT{
+    tmt_msg_t m;
+    TMTSCROLL scroll; /* for TMT_MSG_SCROLL */
+    TMTMATCH match;   /* for TMT_MSG_MATCH */
+    char s[64];       /* for TMT_MSG_ANSWER and TMT_MSG_CURSOR */
+};
+
+/**** PUBLIC FUNCTIONS */
+TMTPOOL *tmt_pool_open(size_t nworker);
+void tmt_pool_close(TMTPOOL *p);
+TMTSESSION *tmt_pool_add(TMTPOOL *p, int fd, size_t nline, size_t ncol,
+                         const wchar_t *acs, void *data);
+void tmt_pool_remove(TMTSESSION *s);
+TMTSESSION *tmt_pool_wait(TMTPOOL *p, int timeout);
+bool tmt_pool_next(TMTSESSION *s, TMTEVENT *e);
+bool tmt_pool_hungup(TMTSESSION *s);
+TMT *tmt_pool_lock(TMTSESSION *s);
+void tmt_pool_unlock(TMTSESSION *s);
+void *tmt_pool_data(const TMTSESSION *s);
+
+#endif
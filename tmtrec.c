@@ -0,0 +1,359 @@
+/* Copyright (c) 2017 Rob King
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the copyright holder nor the
+ *     names of contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS,
+ * COPYRIGHT HOLDERS, OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "tmtrec.h"
+
+#define REC_MAGIC 0x52544d54 /* "TMTR" */
+#define IDX_MAGIC 0x49544d54 /* "TMTI" */
+#define REC_VERSION 1
+#define EVERY (1 << 20)
+#define CHUNK_MAX (1u << 30)
+#define FILEHEAD 8
+#define HEAD 16
+#define FOOT 24
+#define MAX(x, y) (((size_t)(x) > (size_t)(y)) ? (size_t)(x) : (size_t)(y))
+#define MIN(x, y) (((size_t)(x) < (size_t)(y)) ? (size_t)(x) : (size_t)(y))
+
+/* A recording starts with a magic number and a version, followed by
+ * records: a 64-bit time, a 32-bit kind, a 32-bit length, and that
+ * many bytes of either output for the terminal or a snapshot of it
+ * (a keyframe).  Closing the recording appends an index of the
+ * keyframes, each a 64-bit time and file offset, and a footer giving
+ * the offset of the index, the time of the last record, the number of
+ * keyframes, and another magic number.  All numbers are little-endian.
+ */
+enum {K_CHUNK, K_KEY};
+
+typedef struct INDEX INDEX;
+struct INDEX{
+    uint64_t t, off;
+};
+
+struct TMTREC{
+    FILE *f;
+    TMT *vt;
+    size_t every, since;
+    uint64_t t, off;
+    bool ok;
+
+    INDEX *idx;
+    size_t nidx, szidx;
+    unsigned char *snap;
+    size_t szsnap;
+};
+
+struct TMTPLAY{
+    FILE *f;
+    TMT *vt;
+    uint64_t end, stop; /* records end at stop */
+
+    INDEX *idx;
+    size_t nidx;
+    unsigned char *snap;
+    size_t szsnap;
+};
+
+static void
+put32(unsigned char *b, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        b[i] = (unsigned char)(v >> (8 * i));
+}
+
+static void
+put64(unsigned char *b, uint64_t v)
+{
+    put32(b, (uint32_t)v);
+    put32(b + 4, (uint32_t)(v >> 32));
+}
+
+static uint32_t
+get32(const unsigned char *b)
+{
+    return b[0] | b[1] << 8 | (uint32_t)b[2] << 16 | (uint32_t)b[3] << 24;
+}
+
+static uint64_t
+get64(const unsigned char *b)
+{
+    return get32(b) | (uint64_t)get32(b + 4) << 32;
+}
+
+static bool
+grow(unsigned char **b, size_t *sz, size_t n)
+{
+    if (n <= *sz) return true;
+    unsigned char *nb = realloc(*b, n);
+    if (!nb) return false;
+    *b = nb;
+    *sz = n;
+    return true;
+}
+
+static bool
+record(TMTREC *r, uint32_t kind, const void *p, size_t n)
+{
+    unsigned char h[HEAD];
+    put64(h, r->t);
+    put32(h + 8, kind);
+    put32(h + 12, (uint32_t)n);
+    r->ok = r->ok && fwrite(h, HEAD, 1, r->f) == 1
+                  && (!n || fwrite(p, n, 1, r->f) == 1);
+    r->off += HEAD + n;
+    return r->ok;
+}
+
+static bool
+keyframe(TMTREC *r)
+{
+    size_t n = tmt_snapshot(r->vt, NULL, 0);
+    if (!grow(&r->snap, &r->szsnap, n))
+        return r->ok = false;
+    tmt_snapshot(r->vt, r->snap, n);
+
+    if (r->nidx == r->szidx){
+        size_t sz = MAX(r->szidx * 2, 16);
+        INDEX *idx = realloc(r->idx, sz * sizeof(INDEX));
+        if (!idx) return r->ok = false;
+        r->idx = idx;
+        r->szidx = sz;
+    }
+    r->idx[r->nidx++] = (INDEX){r->t, r->off};
+    r->since = 0;
+    return record(r, K_KEY, r->snap, n);
+}
+
+TMTREC *
+tmt_rec_open(FILE *f, TMT *vt, size_t every)
+{
+    unsigned char h[FILEHEAD];
+    TMTREC *r = calloc(1, sizeof(TMTREC));
+    if (!r) return NULL;
+
+    r->f = f;
+    r->vt = vt;
+    r->every = every? every : EVERY;
+    r->off = FILEHEAD;
+    put32(h, REC_MAGIC);
+    put32(h + 4, REC_VERSION);
+    r->ok = fwrite(h, FILEHEAD, 1, f) == 1;
+    if (!keyframe(r)){
+        free(r->idx);
+        free(r->snap);
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+bool
+tmt_rec_write(TMTREC *r, uint64_t t, const char *s, size_t n)
+{
+    n = n? n : strlen(s);
+    r->t = t > r->t? t : r->t;
+    for (size_t k; n; s += k, n -= k){
+        k = MIN(n, CHUNK_MAX);
+        tmt_write(r->vt, s, k);
+        record(r, K_CHUNK, s, k);
+        if ((r->since += k) >= r->every)
+            keyframe(r);
+    }
+    return r->ok;
+}
+
+bool
+tmt_rec_resize(TMTREC *r, uint64_t t, size_t nline, size_t ncol)
+{
+    /* Replaying output can't resize the terminal, so start afresh. */
+    r->t = t > r->t? t : r->t;
+    return tmt_resize(r->vt, nline, ncol) && keyframe(r);
+}
+
+bool
+tmt_rec_close(TMTREC *r)
+{
+    unsigned char b[FOOT];
+    for (size_t i = 0; i < r->nidx; i++){
+        put64(b, r->idx[i].t);
+        put64(b + 8, r->idx[i].off);
+        r->ok = r->ok && fwrite(b, 16, 1, r->f) == 1;
+    }
+    put64(b, r->off);
+    put64(b + 8, r->t);
+    put32(b + 16, (uint32_t)r->nidx);
+    put32(b + 20, IDX_MAGIC);
+    r->ok = r->ok && fwrite(b, FOOT, 1, r->f) == 1 && fflush(r->f) == 0;
+
+    bool ok = r->ok;
+    free(r->idx);
+    free(r->snap);
+    free(r);
+    return ok;
+}
+
+static bool
+readat(FILE *f, uint64_t off, void *b, size_t n)
+{
+    return fseek(f, (long)off, SEEK_SET) == 0 && (!n || fread(b, n, 1, f) == 1);
+}
+
+static bool
+addkey(TMTPLAY *p, size_t *sz, uint64_t t, uint64_t off)
+{
+    if (p->nidx == *sz){
+        size_t nsz = MAX(*sz * 2, 16);
+        INDEX *idx = realloc(p->idx, nsz * sizeof(INDEX));
+        if (!idx) return false;
+        p->idx = idx;
+        *sz = nsz;
+    }
+    p->idx[p->nidx++] = (INDEX){t, off};
+    return true;
+}
+
+static bool
+loadindex(TMTPLAY *p, uint64_t size)
+{
+    unsigned char b[FOOT];
+    if (size < FILEHEAD + FOOT || !readat(p->f, size - FOOT, b, FOOT)
+        || get32(b + 20) != IDX_MAGIC)
+        return false;
+
+    uint64_t off = get64(b), end = get64(b + 8), n = get32(b + 16);
+    if (off < FILEHEAD || off > size - FOOT || size - FOOT - off != n * 16
+        || fseek(p->f, (long)off, SEEK_SET) != 0)
+        return false;
+
+    size_t sz = 0;
+    for (uint64_t i = 0; i < n; i++)
+        if (fread(b, 16, 1, p->f) != 1 || !addkey(p, &sz, get64(b), get64(b + 8)))
+            return false;
+    p->stop = off;
+    p->end = end;
+    return true;
+}
+
+static bool
+scan(TMTPLAY *p, uint64_t size)
+{
+    /* A recording that was never closed has no index; make one by
+     * reading the records, up to the last complete one.
+     */
+    unsigned char h[HEAD];
+    size_t sz = 0;
+    uint64_t off = FILEHEAD;
+
+    p->nidx = 0;
+    p->end = 0;
+    while (off + HEAD <= size && readat(p->f, off, h, HEAD)){
+        uint64_t n = HEAD + (uint64_t)get32(h + 12);
+        if (off + n > size)
+            break;
+        if (get32(h + 8) == K_KEY && !addkey(p, &sz, get64(h), off))
+            return false;
+        p->end = get64(h);
+        off += n;
+    }
+    p->stop = off;
+    return true;
+}
+
+TMTPLAY *
+tmt_play_open(FILE *f, TMT *vt)
+{
+    unsigned char h[FILEHEAD];
+    TMTPLAY *p = calloc(1, sizeof(TMTPLAY));
+    if (!p) return NULL;
+
+    p->f = f;
+    p->vt = vt;
+    long size = fseek(f, 0, SEEK_END) == 0? ftell(f) : -1;
+    if (size < 0 || !readat(f, 0, h, FILEHEAD) || get32(h) != REC_MAGIC
+        || get32(h + 4) != REC_VERSION
+        || (!loadindex(p, (uint64_t)size) && !scan(p, (uint64_t)size))
+        || !p->nidx)
+        return tmt_play_close(p), NULL;
+    return p;
+}
+
+void
+tmt_play_close(TMTPLAY *p)
+{
+    if (p){
+        free(p->idx);
+        free(p->snap);
+    }
+    free(p);
+}
+
+uint64_t
+tmt_play_end(const TMTPLAY *p)
+{
+    return p->end;
+}
+
+bool
+tmt_seek(TMTPLAY *p, uint64_t t)
+{
+    /* Restore the last keyframe at or before t, then replay the output
+     * that follows it up to t, reading it straight into the terminal.
+     */
+    unsigned char h[HEAD];
+    size_t lo = 0, hi = p->nidx;
+    while (hi - lo > 1){
+        size_t m = lo + (hi - lo) / 2;
+        if (p->idx[m].t <= t)
+            lo = m;
+        else
+            hi = m;
+    }
+
+    uint64_t off = p->idx[lo].off;
+    if (!readat(p->f, off, h, HEAD) || get32(h + 8) != K_KEY)
+        return false;
+    size_t n = get32(h + 12);
+    if (!grow(&p->snap, &p->szsnap, n) || fread(p->snap, n, 1, p->f) != 1)
+        return false;
+
+    tmt_begin_batch(p->vt);
+    bool ok = tmt_restore(p->vt, p->snap, n);
+    for (off += HEAD + n; ok && off + HEAD <= p->stop; off += HEAD + n){
+        if (fread(h, HEAD, 1, p->f) != 1 || get32(h + 8) != K_CHUNK || get64(h) > t)
+            break;
+        n = get32(h + 12);
+        for (size_t k = 0, sz, left = n; ok && left; left -= k){
+            char *b = tmt_inbuf(p->vt, &sz);
+            ok = b && fread(b, k = MIN(left, sz), 1, p->f) == 1;
+            if (ok)
+                tmt_commit(p->vt, k);
+        }
+    }
+    tmt_end_batch(p->vt);
+    return ok;
+}
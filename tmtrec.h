@@ -0,0 +1,49 @@
+/* Copyright (c) 2017 Rob King
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the copyright holder nor the
+ *     names of contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS,
+ * COPYRIGHT HOLDERS, OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TMTREC_H
+#define TMTREC_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include "tmt.h"
+
+typedef struct TMTREC TMTREC;
+typedef struct TMTPLAY TMTPLAY;
+
+/**** PUBLIC FUNCTIONS */
+TMTREC *tmt_rec_open(FILE *f, TMT *vt, size_t every);
+bool tmt_rec_write(TMTREC *r, uint64_t t, const char *s, size_t n);
+bool tmt_rec_resize(TMTREC *r, uint64_t t, size_t nline, size_t ncol);
+bool tmt_rec_close(TMTREC *r);
+
+TMTPLAY *tmt_play_open(FILE *f, TMT *vt);
+void tmt_play_close(TMTPLAY *p);
+uint64_t tmt_play_end(const TMTPLAY *p);
+bool tmt_seek(TMTPLAY *p, uint64_t t);
+
+#endif
@@ -0,0 +1,465 @@
+/* Copyright (c) 2017 Rob King
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the copyright holder nor the
+ *     names of contributors may be used to endorse or promote products
+ *     derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS,
+ * COPYRIGHT HOLDERS, OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+ * USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+ * ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tmtrender.h"
+
+#define SCROLL_MAX 16
+#define SEQ_MAX TMT_RENDER_MIN
+#define MIN(x, y) (((size_t)(x) < (size_t)(y)) ? (size_t)(x) : (size_t)(y))
+
+/* The renderer keeps a copy of what it believes is on the real terminal,
+ * and where its cursor is and what rendition it is using, and sends only
+ * what it takes to make that match the virtual terminal.
+ */
+struct TMTRENDER{
+    TMT *vt;
+    size_t nline, ncol;
+    TMTCHAR *shadow;
+
+    TMTPOINT curs;
+    TMTATTRS sgr;
+    bool cknown, sknown, clear, full;
+
+    TMTSCROLL scrolls[SCROLL_MAX];
+    size_t nscroll;
+
+    char *b;
+    size_t n, len;
+};
+
+static const TMTATTRS defattrs = {.fg = TMT_COLOR_DEFAULT,
+                                  .bg = TMT_COLOR_DEFAULT};
+static const TMTCHAR blank = {L' ', {.fg = TMT_COLOR_DEFAULT,
+                                     .bg = TMT_COLOR_DEFAULT}};
+
+static bool
+sameattrs(TMTATTRS a, TMTATTRS b)
+{
+    return !memcmp(&a, &b, sizeof(TMTATTRS));
+}
+
+static bool
+samechar(const TMTCHAR *a, const TMTCHAR *b)
+{
+    return a->c == b->c && sameattrs(a->a, b->a);
+}
+
+static bool
+emit(TMTRENDER *r, const char *s, size_t n)
+{
+    if (n > r->n - r->len) return false;
+    memcpy(r->b + r->len, s, n);
+    r->len += n;
+    return true;
+}
+
+static size_t
+encode(wchar_t w, char *s)
+{
+    /* Control characters must never reach the real terminal. */
+    if (w < 0x20 || (w >= 0x7f && w < 0xa0)) w = L' ';
+    if (w < 0x80) return *s = (char)w, 1;
+
+    #ifdef TMT_UTF8
+    unsigned long c = (unsigned long)w;
+    if (c > 0x10ffff || (c >= 0xd800 && c < 0xe000)) c = 0xfffd;
+    if (c < 0x800){
+        s[0] = (char)(0xc0 | c >> 6);
+        s[1] = (char)(0x80 | (c & 0x3f));
+        return 2;
+    } else if (c < 0x10000){
+        s[0] = (char)(0xe0 | c >> 12);
+        s[1] = (char)(0x80 | (c >> 6 & 0x3f));
+        s[2] = (char)(0x80 | (c & 0x3f));
+        return 3;
+    }
+    s[0] = (char)(0xf0 | c >> 18);
+    s[1] = (char)(0x80 | (c >> 12 & 0x3f));
+    s[2] = (char)(0x80 | (c >> 6 & 0x3f));
+    s[3] = (char)(0x80 | (c & 0x3f));
+    return 4;
+    #else
+    mbstate_t ms = {0};
+    size_t n = wcrtomb(s, w, &ms);
+    return n == (size_t)-1? (*s = '?', 1) : n;
+    #endif
+}
+
+static size_t
+seq(char *s, size_t n, char f)
+{
+    /* A sequence with a count that defaults to 1, like CUU or CUF. */
+    return n == 1? (size_t)sprintf(s, "\033[%c", f)
+                 : (size_t)sprintf(s, "\033[%zu%c", n, f);
+}
+
+static void
+param(char *s, size_t *n, int p)
+{
+    *n += sprintf(s + *n, *n > 2? ";%d" : "%d", p);
+}
+
+static void
+color(const TMTRENDER *r, char *s, size_t *n, int c, bool bg)
+{
+    unsigned char rgb[3];
+    if (c >= TMT_COLOR_BLACK && c < TMT_COLOR_MAX)
+        param(s, n, (bg? 40 : 30) + c - TMT_COLOR_BLACK);
+    else if (c >= TMT_COLOR_PALETTE && c < TMT_COLOR_PALETTE + 256){
+        param(s, n, bg? 48 : 38);
+        param(s, n, 5);
+        param(s, n, c - TMT_COLOR_PALETTE);
+    } else if (c >= TMT_COLOR_RGB && tmt_color_rgb(r->vt, c, rgb)){
+        param(s, n, bg? 48 : 38);
+        param(s, n, 2);
+        for (int i = 0; i < 3; i++)
+            param(s, n, rgb[i]);
+    } else
+        param(s, n, bg? 49 : 39);
+}
+
+static size_t
+sgrfull(const TMTRENDER *r, TMTATTRS a, char *s)
+{
+    size_t n = 3;
+    memcpy(s, "\033[0", 3);
+    if (a.bold)      param(s, &n, 1);
+    if (a.dim)       param(s, &n, 2);
+    if (a.underline) param(s, &n, 4);
+    if (a.blink)     param(s, &n, 5);
+    if (a.reverse)   param(s, &n, 7);
+    if (a.invisible) param(s, &n, 8);
+    if (a.fg != TMT_COLOR_DEFAULT) color(r, s, &n, a.fg, false);
+    if (a.bg != TMT_COLOR_DEFAULT) color(r, s, &n, a.bg, true);
+    if (n == 3) n--;
+    s[n++] = 'm';
+    return n;
+}
+
+static size_t
+sgrdelta(const TMTRENDER *r, TMTATTRS a, char *s)
+{
+    /* Terminals disagree about whether 22 turns off dim as well as bold,
+     * so only the full form is used to turn either off.
+     */
+    TMTATTRS o = r->sgr;
+    size_t n = 2;
+    if ((o.bold && !a.bold) || (o.dim && !a.dim)) return SIZE_MAX;
+
+    memcpy(s, "\033[", 2);
+    if (a.bold && !o.bold)                param(s, &n, 1);
+    if (a.dim && !o.dim)                  param(s, &n, 2);
+    if (a.underline != o.underline)       param(s, &n, a.underline? 4 : 24);
+    if (a.blink != o.blink)               param(s, &n, a.blink? 5 : 25);
+    if (a.reverse != o.reverse)           param(s, &n, a.reverse? 7 : 27);
+    if (a.invisible != o.invisible)       param(s, &n, a.invisible? 8 : 28);
+    if (a.fg != o.fg)                     color(r, s, &n, a.fg, false);
+    if (a.bg != o.bg)                     color(r, s, &n, a.bg, true);
+    if (n == 2) return 0;
+    s[n++] = 'm';
+    return n;
+}
+
+static bool
+setsgr(TMTRENDER *r, TMTATTRS a)
+{
+    char s[SEQ_MAX], d[SEQ_MAX];
+    if (r->sknown && sameattrs(r->sgr, a)) return true;
+
+    size_t n = sgrfull(r, a, s);
+    if (r->sknown){
+        size_t m = sgrdelta(r, a, d);
+        if (m < n) memcpy(s, d, n = m);
+    }
+    if (!emit(r, s, n)) return false;
+    r->sgr = a;
+    r->sknown = true;
+    return true;
+}
+
+static size_t
+horizontal(const TMTRENDER *r, size_t row, size_t col, char *s)
+{
+    /* Candidates are CUF, CUB, CR, backspaces, and simply writing out
+     * again the characters the cursor would pass over.
+     */
+    char t[SEQ_MAX];
+    size_t c = r->curs.c, n = 0, m;
+    if (col == c) return 0;
+
+    if (col > c){
+        n = seq(s, col - c, 'C');
+        const TMTCHAR *h = r->shadow + row * r->ncol;
+        bool ok = r->sknown && col - c < n;
+        for (size_t i = c; ok && i < col; i++)
+            ok = h[i].c >= 0x20 && h[i].c < 0x7f && sameattrs(h[i].a, r->sgr);
+        if (ok){
+            for (size_t i = c; i < col; i++)
+                s[i - c] = (char)h[i].c;
+            n = col - c;
+        }
+    } else{
+        n = seq(s, c - col, 'D');
+        if (c - col < n){
+            memset(s, '\b', c - col);
+            n = c - col;
+        }
+    }
+
+    t[0] = '\r';
+    m = 1 + (col? seq(t + 1, col, 'C') : 0);
+    if (m < n) memcpy(s, t, n = m);
+    return n;
+}
+
+static size_t
+movement(const TMTRENDER *r, size_t row, size_t col, char *s)
+{
+    char t[SEQ_MAX];
+    size_t n = 0, m;
+
+    if (!row && !col)
+        n = (size_t)sprintf(s, "\033[H");
+    else if (!col)
+        n = (size_t)sprintf(s, "\033[%zuH", row + 1);
+    else
+        n = (size_t)sprintf(s, "\033[%zu;%zuH", row + 1, col + 1);
+    if (!r->cknown) return n;
+
+    m = 0;
+    if (row < r->curs.r)
+        m = seq(t, r->curs.r - row, 'A');
+    else if (row > r->curs.r)
+        m = seq(t, row - r->curs.r, 'B');
+    m += horizontal(r, row, col, t + m);
+    if (m < n) memcpy(s, t, n = m);
+    return n;
+}
+
+static bool
+moveto(TMTRENDER *r, size_t row, size_t col)
+{
+    char s[SEQ_MAX * 2];
+    if (r->cknown && r->curs.r == row && r->curs.c == col) return true;
+    if (!emit(r, s, movement(r, row, col, s))) return false;
+    r->curs.r = row;
+    r->curs.c = col;
+    r->cknown = true;
+    return true;
+}
+
+static bool
+clearscreen(TMTRENDER *r)
+{
+    if (!setsgr(r, defattrs) || !emit(r, "\033[H\033[2J", 7)) return false;
+    for (size_t i = 0; i < r->nline * r->ncol; i++)
+        r->shadow[i] = blank;
+    r->curs.r = r->curs.c = 0;
+    r->cknown = r->full = true;
+    r->clear = false;
+    r->nscroll = 0;
+    return true;
+}
+
+static bool
+scroll(TMTRENDER *r, const TMTSCROLL *q)
+{
+    /* Whole-screen scrolls are SU and SD; scrolls to the bottom are DL
+     * and IL on the first line; anything else needs a scrolling region.
+     */
+    char s[SEQ_MAX * 2];
+    size_t e = MIN(q->e, r->nline), m = 0, w = r->ncol;
+    if (q->s + 1 >= e || !q->n) return true;
+    size_t n = MIN(q->n, e - q->s - 1);
+
+    if (!setsgr(r, defattrs)) return false;
+    if (q->s == 0 && e == r->nline)
+        m = (size_t)sprintf(s, "\033[%zu%c", n, q->up? 'S' : 'T');
+    else if (e == r->nline){
+        if (!moveto(r, q->s, 0)) return false;
+        m = (size_t)sprintf(s, "\033[%zu%c", n, q->up? 'M' : 'L');
+    } else
+        m = (size_t)sprintf(s, "\033[%zu;%zur\033[%zu%c\033[r", q->s + 1, e,
+                            n, q->up? 'S' : 'T');
+    if (!emit(r, s, m)) return false;
+    r->cknown = r->cknown && q->s == 0 && e == r->nline;
+
+    TMTCHAR *h = r->shadow + q->s * w;
+    size_t k = (e - q->s - n) * w;
+    if (q->up){
+        memmove(h, h + n * w, k * sizeof(TMTCHAR));
+        h += k;
+    } else
+        memmove(h + n * w, h, k * sizeof(TMTCHAR));
+    for (size_t i = 0; i < n * w; i++)
+        h[i] = blank;
+    return true;
+}
+
+static bool
+drawline(TMTRENDER *r, size_t row, size_t s, size_t e)
+{
+    const TMTCHAR *l = tmt_screen(r->vt)->lines[row]->chars;
+    TMTCHAR *h = r->shadow + row * r->ncol;
+    size_t w = r->ncol, b = w;
+    while (b && samechar(&l[b - 1], &blank))
+        b--;
+
+    for (size_t c = s; c < e; ){
+        if (samechar(&l[c], &h[c])){
+            c++;
+            continue;
+        }
+
+        /* The second half of a double-width character is drawn along
+         * with the first.
+         */
+        if (!l[c].c && c && l[c - 1].c)
+            c--;
+        else if (!l[c].c){
+            h[c] = l[c];
+            c++;
+            continue;
+        }
+
+        /* Use EL if the rest of the line is blank and it saves anything. */
+        size_t d = 0;
+        for (size_t i = c; c >= b && i < w; i++)
+            d += !samechar(&l[i], &h[i]);
+        if (d > 3){
+            if (!moveto(r, row, c) || !setsgr(r, defattrs)
+                || !emit(r, "\033[K", 3))
+                return false;
+            memcpy(h + c, l + c, (w - c) * sizeof(TMTCHAR));
+            return true;
+        }
+
+        /* Use REP for a run of the same character if it saves anything. */
+        char t[SEQ_MAX];
+        size_t k = 1, n = encode(l[c].c, t);
+        while (c + k < e && samechar(&l[c + k], &l[c]))
+            k++;
+        if (k > 1 && k * n > n + seq(t + n, k - 1, 'b'))
+            n += seq(t + n, k - 1, 'b');
+        else
+            k = c + 1 < w && !l[c + 1].c? 2 : 1;
+
+        if (!moveto(r, row, c) || !setsgr(r, l[c].a) || !emit(r, t, n))
+            return false;
+        memcpy(h + c, l + c, k * sizeof(TMTCHAR));
+        c += k;
+
+        /* After writing to the last column, where the cursor is depends
+         * on the terminal.
+         */
+        r->curs.c = c;
+        r->cknown = c < w;
+    }
+    return true;
+}
+
+TMTRENDER *
+tmt_render_open(TMT *vt)
+{
+    TMTRENDER *r = calloc(1, sizeof(TMTRENDER));
+    if (!r) return NULL;
+
+    r->vt = vt;
+    r->clear = true;
+    return r;
+}
+
+void
+tmt_render_close(TMTRENDER *r)
+{
+    if (r) free(r->shadow);
+    free(r);
+}
+
+void
+tmt_render_scroll(TMTRENDER *r, const TMTSCROLL *s)
+{
+    TMTSCROLL *l = r->nscroll? &r->scrolls[r->nscroll - 1] : NULL;
+    if (l && l->s == s->s && l->e == s->e && l->up == s->up
+          && l->n + s->n < l->e - l->s)
+        l->n += s->n;
+    else if (r->nscroll < SCROLL_MAX)
+        r->scrolls[r->nscroll++] = *s;
+    else{
+        /* Too many to replay; compare the whole screen instead. */
+        r->nscroll = 0;
+        r->full = true;
+    }
+}
+
+void
+tmt_render_reset(TMTRENDER *r)
+{
+    r->clear = true;
+    r->cknown = r->sknown = false;
+}
+
+size_t
+tmt_render(TMTRENDER *r, char *b, size_t n)
+{
+    const TMTSCREEN *s = tmt_screen(r->vt);
+    const TMTPOINT *c = tmt_cursor(r->vt);
+    r->b = b;
+    r->n = n;
+    r->len = 0;
+
+    if (s->nline != r->nline || s->ncol != r->ncol){
+        TMTCHAR *h = realloc(r->shadow, s->nline * s->ncol * sizeof(TMTCHAR));
+        if (!h) return TMT_RENDER_FAILED;
+        r->shadow = h;
+        r->nline = s->nline;
+        r->ncol = s->ncol;
+        r->clear = true;
+    }
+    if (r->clear && !clearscreen(r))
+        return r->len;
+
+    for (; r->nscroll; r->nscroll--){
+        if (!scroll(r, r->scrolls)) return r->len;
+        memmove(r->scrolls, r->scrolls + 1, (r->nscroll - 1) * sizeof(TMTSCROLL));
+    }
+
+    for (size_t i = 0, j = 0, k = r->ncol; ; i++){
+        if (r->full && i >= r->nline) break;
+        if (!r->full && !tmt_damage_next(r->vt, &i, &j, &k)) break;
+        if (!drawline(r, i, j, k)) return r->len;
+    }
+
+    if (!moveto(r, MIN(c->r, r->nline - 1), MIN(c->c, r->ncol - 1)))
+        return r->len;
+    r->full = false;
+    return r->len;
+}
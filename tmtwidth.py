@@ -0,0 +1,86 @@
+# Copyright (c) 2017 Rob King
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#   * Redistributions of source code must retain the above copyright
+#     notice, this list of conditions and the following disclaimer.
+#   * Redistributions in binary form must reproduce the above copyright
+#     notice, this list of conditions and the following disclaimer in the
+#     documentation and/or other materials provided with the distribution.
+#   * Neither the name of the copyright holder nor the
+#     names of contributors may be used to endorse or promote products
+#     derived from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER AND CONTRIBUTORS
+# "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+# LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+# A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS,
+# COPYRIGHT HOLDERS, OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+# INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+# BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF
+# USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON
+# ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Generates tmtwidth.h, the character width table used by tmt.c, from the
+# Unicode database that comes with Python:
+#
+#     python3 tmtwidth.py > tmtwidth.h
+#
+# Each codepoint gets two bits: 0 for an ordinary character, 1 for a
+# double-width one, 2 for one that takes no space (combining marks and
+# the like), and 3 for one that isn't printed at all.  Codepoints are
+# looked up 256 at a time: widthindex says which of the distinct blocks
+# of 64 bytes in widthblocks describes them.
+
+import sys
+import unicodedata
+
+NORMAL, WIDE, ZERO, NONPRINTING = range(4)
+BLOCK = 256
+
+def width(cp):
+    c = chr(cp)
+    cat = unicodedata.category(c)
+    if cat in ('Cc', 'Cs'):
+        return NONPRINTING
+    if cp == 0x00ad:
+        return NORMAL
+    if cat in ('Mn', 'Me', 'Cf') or 0x1160 <= cp <= 0x11ff or 0xd7b0 <= cp <= 0xd7ff:
+        return ZERO
+    if unicodedata.east_asian_width(c) in ('W', 'F'):
+        return WIDE
+    return NORMAL
+
+def block(base):
+    b = bytearray(BLOCK // 4)
+    for i in range(BLOCK):
+        b[i // 4] |= width(base + i) << (i % 4 * 2)
+    return bytes(b)
+
+def main():
+    blocks, index = {}, []
+    for base in range(0, 0x110000, BLOCK):
+        index.append(blocks.setdefault(block(base), len(blocks)))
+    assert len(blocks) <= 256
+
+    out = sys.stdout
+    out.write('/* Generated by tmtwidth.py from Unicode %s; do not edit. */\n\n'
+              % unicodedata.unidata_version)
+    out.write('static const unsigned char widthindex[0x%x] = {\n' % len(index))
+    for i in range(0, len(index), 16):
+        out.write('    %s,\n' % ', '.join('%3d' % x for x in index[i:i + 16]))
+    out.write('};\n\n')
+    out.write('static const unsigned char widthblocks[%d][%d] = {\n'
+              % (len(blocks), BLOCK // 4))
+    for b in sorted(blocks, key=blocks.get):
+        out.write('    {\n')
+        for i in range(0, len(b), 16):
+            out.write('        %s,\n' % ', '.join('0x%02x' % x for x in b[i:i + 16]))
+        out.write('    },\n')
+    out.write('};\n')
+
+if __name__ == '__main__':
+    main()